@@ -0,0 +1,92 @@
+/*
+ * bench-run.c
+ *
+ * Runs a command and reports what it cost: wall clock time, CPU time,
+ * the peak resident set size and the context switches, as reported by
+ * wait4() for the command and every descendant it waited for.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+static void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-o OUT_FILE] <command> [args...]\n\n"
+			"    Runs the command, with its standard output going to OUT_FILE\n"
+			"    (default: /dev/null), then prints on standard output:\n"
+			"    wall_ms user_ms sys_ms maxrss_kb nvcsw nivcsw exit_status\n",
+			argv0);
+	exit(1);
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static double tv_ms(struct timeval *tv)
+{
+	return tv->tv_sec * 1e3 + tv->tv_usec / 1e3;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *out_filename = "/dev/null";
+	struct rusage ru;
+	double start, end;
+	int opt, fd, status;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "+o:")) != -1) {
+		switch (opt) {
+		case 'o':
+			out_filename = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage(argv[0]);
+
+	fflush(stdout);
+	start = now_ms();
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		fd = open(out_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror(out_filename);
+			exit(1);
+		}
+		dup2(fd, 1);
+		close(fd);
+		execvp(argv[optind], argv + optind);
+		perror(argv[optind]);
+		exit(127);
+	}
+
+	if (wait4(pid, &status, 0, &ru) < 0) {
+		perror("wait4");
+		exit(1);
+	}
+	end = now_ms();
+
+	printf("%.3f %.3f %.3f %ld %ld %ld %d\n",
+		end - start, tv_ms(&ru.ru_utime), tv_ms(&ru.ru_stime),
+		ru.ru_maxrss, ru.ru_nvcsw, ru.ru_nivcsw,
+		WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+	return 0;
+}
@@ -0,0 +1,112 @@
+#!/bin/bash
+#
+# bench.sh: runs main1.1 - main1.4 and the main1.4 engines over
+# generated trees and prints one line per run:
+#
+#   wall:   wall clock time of the whole run
+#   eval:   the evaluation time the program reports itself
+#           (critical path latency for the process tree)
+#   build:  wall - eval (times the runs of -r), i.e. parsing plus
+#           creating the processes, threads or bytecode
+#   rss:    peak resident set size of the largest process
+#   user, sys: CPU time of all the processes
+#   csw:    voluntary + involuntary context switches
+#   calls:  system calls, counted with strace -f -c if it is installed
+#
+# Tunables (environment):
+#   BENCH_NODES   size of the trees for one process per node (1000)
+#   BENCH_BIG     size of the trees for the in-process engines (100000)
+#   BENCH_REPEAT  -r for the engines that support it (5)
+#   BENCH_DIR     where the trees go (bench-trees)
+#   BENCH_SLOW    set to 0 to skip main1.1 and main1.2, which sleep
+#                 for a fixed time whatever the tree
+
+NODES=${BENCH_NODES:-1000}
+BIG=${BENCH_BIG:-100000}
+REPEAT=${BENCH_REPEAT:-5}
+DIR=${BENCH_DIR:-bench-trees}
+SLOW=${BENCH_SLOW:-1}
+
+# Chains and skewed trees are as deep as they are big, and the tree
+# parser recurses once per level, so they are only generated small.
+SMALL_SHAPES="balanced skewed chain wide random"
+BIG_SHAPES="balanced wide random"
+
+HAVE_STRACE=0
+command -v strace >/dev/null 2>&1 && HAVE_STRACE=1
+
+mkdir -p "$DIR" || exit 1
+for shape in $SMALL_SHAPES; do
+	./tree-gen "$shape" "$NODES" "$DIR/$shape-$NODES.tree" || exit 1
+done
+for shape in $BIG_SHAPES; do
+	./tree-gen "$shape" "$BIG" "$DIR/$shape-$BIG.tree" || exit 1
+done
+
+count_syscalls()
+{
+	local log="$DIR/strace.out"
+
+	if [ $HAVE_STRACE -eq 0 ]; then
+		echo "-"
+		return
+	fi
+	strace -f -c -o "$log" "$@" >/dev/null 2>&1
+	awk '$NF == "total" { print $4 }' "$log"
+}
+
+# run LABEL ENGINE TREE RUNS command...
+run()
+{
+	local label=$1 engine=$2 tree=$3 runs=$4 out="$DIR/run.out" eval build
+	local wall user sys rss nvcsw nivcsw status calls
+	shift 4
+
+	read wall user sys rss nvcsw nivcsw status < <(./bench-run -o "$out" "$@" 2>/dev/null)
+	if [ "$status" != 0 ]; then
+		printf "%-8s %-11s %-22s failed, exit status %s\n" "$label" "$engine" "$tree" "$status"
+		return
+	fi
+
+	eval=$(sed -n -e 's/^evaluation time = \([0-9.]*\) ms.*/\1/p' \
+		-e 's/^critical path latency = \([0-9.]*\) ms.*/\1/p' "$out" | head -1)
+	if [ -n "$eval" ]; then
+		build=$(awk -v w="$wall" -v e="$eval" -v n="$runs" 'BEGIN { printf "%.3f", w - e * n }')
+	else
+		eval="-"
+		build="-"
+	fi
+	calls=$(count_syscalls "$@")
+
+	printf "%-8s %-11s %-22s %10s %10s %10s %8s %8.1f %8.1f %7d %8s\n" \
+		"$label" "$engine" "$tree" "$wall" "$build" "$eval" "$rss" \
+		"$user" "$sys" $((nvcsw + nivcsw)) "$calls"
+}
+
+printf "%-8s %-11s %-22s %10s %10s %10s %8s %8s %8s %7s %8s\n" \
+	program engine tree wall_ms build_ms eval_ms rss_kb user_ms sys_ms csw calls
+[ $HAVE_STRACE -eq 1 ] || echo "# strace not found, system calls are not counted"
+
+if [ "$SLOW" != 0 ]; then
+	run main1.1 - builtin 1 ./main1.1
+	run main1.2 - "balanced-$NODES" 1 ./main1.2 "$DIR/balanced-$NODES.tree"
+fi
+
+for shape in $SMALL_SHAPES; do
+	tree="$DIR/$shape-$NODES.tree"
+	run main1.3 - "$shape-$NODES" 1 ./main1.3 "$tree"
+	run main1.4 procs "$shape-$NODES" 1 ./main1.4 -q "$tree"
+	run main1.4 procs-a "$shape-$NODES" 1 ./main1.4 -q -a "$tree"
+	run main1.4 pool "$shape-$NODES" 1 ./main1.4 -q --engine=pool "$tree"
+done
+
+for shape in $BIG_SHAPES; do
+	tree="$DIR/$shape-$BIG.tree"
+	run main1.4 procs-a "$shape-$BIG" 1 ./main1.4 -q -a "$tree"
+	run main1.4 procs-ac "$shape-$BIG" 1 ./main1.4 -q -a -c "$tree"
+	run main1.4 pool-s100 "$shape-$BIG" "$REPEAT" ./main1.4 -q --engine=pool -s 100 -r "$REPEAT" "$tree"
+	for engine in threads recursive bytecode; do
+		run main1.4 $engine "$shape-$BIG" "$REPEAT" ./main1.4 -q --engine=$engine -r "$REPEAT" "$tree"
+		run main1.4 $engine-c "$shape-$BIG" "$REPEAT" ./main1.4 -q -c --engine=$engine -r "$REPEAT" "$tree"
+	done
+done
@@ -0,0 +1,21 @@
+#ifndef EXPR_BATCH_H
+#define EXPR_BATCH_H
+
+#include "expr-bytecode.h"
+
+/******************************************************************************
+ * Helper Functions
+ */
+
+/*
+ * Evaluates compiled bytecode for nr_rows bindings of its variables.
+ * vars[i] is the column of values of variable i (bc->vars[i]), out
+ * receives one result per row.
+ *
+ * The rows are processed in blocks, one instruction at a time over a
+ * whole block, with SIMD over 64-bit lanes.
+ */
+void expr_batch_eval(const struct expr_bc *bc, long long *const *vars,
+	unsigned long nr_rows, long long *out);
+
+#endif /* EXPR_BATCH_H */
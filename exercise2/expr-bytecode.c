@@ -0,0 +1,237 @@
+/*
+ * expr-bytecode.c
+ *
+ * Compiles an expression tree into a flat postfix instruction array.
+ *
+ * Operators and leaf values are decoded once, at compile time, so
+ * running the program needs no strcmp() on node names and no parsing
+ * of leaves, and walks one contiguous array instead of chasing child
+ * pointers through the tree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr.h"
+#include "expr-dag.h"
+#include "expr-bytecode.h"
+
+struct compiler {
+	struct expr_bc *bc;
+	unsigned long depth;	/* values on the stack at this point */
+
+	/* DAG only: slot of every shared node, + 1 once it has been emitted */
+	unsigned long *slot;
+};
+
+static void emit(struct compiler *c, int op, unsigned argc, long long val)
+{
+	struct bc_insn *insn = &c->bc->code[c->bc->len++];
+
+	insn->op = op;
+	insn->argc = argc;
+	insn->val = val;
+
+	/* every instruction leaves exactly one value for the ones it pops */
+	if (op != BC_TEE)
+		c->depth = c->depth - argc + 1;
+	if (c->depth > c->bc->max_stack)
+		c->bc->max_stack = c->depth;
+}
+
+/* returns the number of a variable, adding it to the table if new */
+static unsigned var_index(struct expr_bc *bc, const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < bc->nr_vars; i++)
+		if (strcmp(bc->vars[i], name) == 0)
+			return i;
+
+	bc->vars = realloc(bc->vars, (bc->nr_vars + 1) * sizeof(*bc->vars));
+	if (bc->vars == NULL) {
+		fprintf(stderr, "variable table allocation failed\n");
+		exit(1);
+	}
+	snprintf(bc->vars[i], NODE_NAME_SIZE, "%s", name);
+	bc->nr_vars++;
+
+	return i;
+}
+
+/* emits the instruction of an operator with argc operands */
+static void emit_op(struct compiler *c, enum expr_op op, unsigned argc)
+{
+	switch (op) {
+	case EXPR_ADD:
+		emit(c, BC_ADD, argc, 0);
+		break;
+	case EXPR_MUL:
+		emit(c, BC_MUL, argc, 0);
+		break;
+	case EXPR_SUB:
+		if (argc == 1)
+			emit(c, BC_NEG, 1, 0);
+		else
+			emit(c, BC_SUB, argc, 0);
+		break;
+	default:
+		fprintf(stderr, "%s: internal error: operator %d\n", __func__, op);
+		exit(1);
+	}
+}
+
+static void compile_node(struct compiler *c, struct tree_node *node)
+{
+	enum expr_op op = expr_op_of(node);
+	unsigned i;
+
+	if (op == EXPR_VAL) {
+		if (expr_leaf_is_var(node))
+			emit(c, BC_VAR, 0, var_index(c->bc, node->name));
+		else
+			emit(c, BC_PUSH, 0, expr_leaf_value(node));
+		return;
+	}
+
+	for (i = 0; i < node->nr_children; i++)
+		compile_node(c, node->children + i);
+
+	emit_op(c, op, node->nr_children);
+}
+
+static void compile_dag_node(struct compiler *c, const struct expr_dag *dag, unsigned id)
+{
+	const struct dag_node *node = &dag->nodes[id];
+	unsigned i;
+
+	if (node->refs > 1 && c->slot[id] != 0) {
+		emit(c, BC_LOAD, 0, c->slot[id] - 1);
+		return;
+	}
+
+	if (node->op != EXPR_VAL) {
+		for (i = 0; i < node->nr_children; i++)
+			compile_dag_node(c, dag, dag->edges[node->first + i]);
+		emit_op(c, node->op, node->nr_children);
+	} else if (node->is_var)
+		emit(c, BC_VAR, 0, var_index(c->bc, node->name));
+	else
+		emit(c, BC_PUSH, 0, node->val);
+
+	/* a leaf is as cheap to push again as to load */
+	if (node->refs > 1 && node->op != EXPR_VAL) {
+		c->slot[id] = ++c->bc->nr_slots;
+		emit(c, BC_TEE, 0, c->slot[id] - 1);
+	}
+}
+
+struct expr_bc *
+expr_bc_compile(struct tree_node *root)
+{
+	struct compiler c;
+	unsigned long nodes;
+
+	/* one instruction per node */
+	nodes = expr_count_nodes(root, -1UL);
+
+	c.depth = 0;
+	c.bc = calloc(1, sizeof(*c.bc));
+	if (c.bc == NULL || (c.bc->code = malloc(nodes * sizeof(struct bc_insn))) == NULL) {
+		fprintf(stderr, "bytecode allocation failed\n");
+		exit(1);
+	}
+
+	compile_node(&c, root);
+
+	return c.bc;
+}
+
+struct expr_bc *
+expr_bc_compile_dag(const struct expr_dag *dag)
+{
+	struct compiler c;
+	unsigned long max_len;
+
+	/* every node once, a load per extra reference, a tee per shared node */
+	max_len = 2 * (unsigned long)dag->nr_nodes + dag->nr_edges;
+
+	c.depth = 0;
+	c.bc = calloc(1, sizeof(*c.bc));
+	c.slot = calloc(dag->nr_nodes, sizeof(*c.slot));
+	if (c.bc == NULL || c.slot == NULL ||
+	    (c.bc->code = malloc(max_len * sizeof(struct bc_insn))) == NULL) {
+		fprintf(stderr, "bytecode allocation failed\n");
+		exit(1);
+	}
+
+	compile_dag_node(&c, dag, dag->root);
+
+	free(c.slot);
+	return c.bc;
+}
+
+/*
+ * The interpreter loop. The arithmetic is done on unsigned
+ * values, to wrap around on overflow like expr_apply().
+ */
+long long
+expr_bc_run(const struct expr_bc *bc, long long *stack, const long long *vars)
+{
+	const struct bc_insn *pc = bc->code, *end = bc->code + bc->len;
+	unsigned long long *sp = (unsigned long long *)stack, acc;
+	long long *slots = stack + bc->max_stack;
+	unsigned i;
+
+	for (; pc < end; pc++) {
+		switch (pc->op) {
+		case BC_PUSH:
+			*sp++ = pc->val;
+			break;
+		case BC_VAR:
+			*sp++ = vars[pc->val];
+			break;
+		case BC_ADD:
+			sp -= pc->argc;
+			acc = sp[0];
+			for (i = 1; i < pc->argc; i++)
+				acc += sp[i];
+			*sp++ = acc;
+			break;
+		case BC_MUL:
+			sp -= pc->argc;
+			acc = sp[0];
+			for (i = 1; i < pc->argc; i++)
+				acc *= sp[i];
+			*sp++ = acc;
+			break;
+		case BC_SUB:
+			sp -= pc->argc;
+			acc = sp[0];
+			for (i = 1; i < pc->argc; i++)
+				acc -= sp[i];
+			*sp++ = acc;
+			break;
+		case BC_NEG:
+			sp[-1] = -sp[-1];
+			break;
+		case BC_TEE:
+			slots[pc->val] = sp[-1];
+			break;
+		case BC_LOAD:
+			*sp++ = slots[pc->val];
+			break;
+		}
+	}
+
+	return sp[-1];
+}
+
+void
+expr_bc_free(struct expr_bc *bc)
+{
+	free(bc->vars);
+	free(bc->code);
+	free(bc);
+}
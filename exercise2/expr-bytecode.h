@@ -0,0 +1,66 @@
+#ifndef EXPR_BYTECODE_H
+#define EXPR_BYTECODE_H
+
+#include "tree.h"
+
+/******************************************************************************
+ * Data structure definitions
+ */
+
+/* opcodes of the postfix bytecode */
+enum bc_opcode {
+	BC_PUSH,	/* push val */
+	BC_VAR,		/* push the value of variable number val */
+	BC_ADD,		/* pop argc values, push their sum */
+	BC_MUL,		/* pop argc values, push their product */
+	BC_SUB,		/* pop argc values, push v0 - v1 - ... */
+	BC_NEG,		/* pop one value, push its negation */
+	BC_TEE,		/* copy the top of the stack into slot val */
+	BC_LOAD,	/* push the value of slot val */
+};
+
+struct bc_insn {
+	int		op;
+	unsigned	argc;
+	long long	val;
+};
+
+/* an expression tree, lowered to one flat array of instructions */
+struct expr_bc {
+	struct bc_insn	*code;
+	unsigned long	len;
+	unsigned long	max_stack;	/* values the interpreter stack must hold */
+	unsigned long	nr_slots;	/* values shared subexpressions are kept in */
+
+	/* names of the variables, in the order BC_VAR numbers them */
+	char		(*vars)[NODE_NAME_SIZE];
+	unsigned	nr_vars;
+};
+
+
+/******************************************************************************
+ * Helper Functions
+ */
+
+struct expr_dag;
+
+/* lowers an expression tree to postfix bytecode, exits on errors */
+struct expr_bc *expr_bc_compile(struct tree_node *root);
+
+/*
+ * Lowers a hash-consed expression DAG to postfix bytecode. The code of
+ * a shared node is emitted once and its value saved to a slot (BC_TEE),
+ * other references to it load the slot (BC_LOAD).
+ */
+struct expr_bc *expr_bc_compile_dag(const struct expr_dag *dag);
+
+/*
+ * Runs the bytecode. stack must have room for bc->max_stack values,
+ * followed by bc->nr_slots more for the slots.
+ * vars holds the value of every variable, it may be NULL if there are none.
+ */
+long long expr_bc_run(const struct expr_bc *bc, long long *stack, const long long *vars);
+
+void expr_bc_free(struct expr_bc *bc);
+
+#endif /* EXPR_BYTECODE_H */
@@ -0,0 +1,174 @@
+/*
+ * expr-cols.c
+ *
+ * Reading and writing columnar files of variable bindings,
+ * see expr-cols.h for the layout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "expr-cols.h"
+
+struct cols_header {
+	char		magic[8];
+	uint32_t	nr_cols;
+	uint32_t	reserved;
+	uint64_t	nr_rows;
+};
+
+static unsigned long round_up(unsigned long n)
+{
+	return (n + COLS_ALIGN - 1) / COLS_ALIGN * COLS_ALIGN;
+}
+
+/* offset of the first column */
+static unsigned long data_offset(unsigned nr_cols)
+{
+	return round_up(sizeof(struct cols_header) + (unsigned long)nr_cols * NODE_NAME_SIZE);
+}
+
+/* bytes of one column, padding included */
+static unsigned long column_size(unsigned long nr_rows)
+{
+	return round_up(nr_rows * sizeof(long long));
+}
+
+/*
+ * Do the columns the header describes fit in len bytes? Divides rather than
+ * multiplies, so that a crafted nr_rows cannot wrap the size around.
+ */
+static int cols_fit(const struct cols_header *hdr, unsigned long len)
+{
+	unsigned long avail;
+
+	if (data_offset(hdr->nr_cols) > len)
+		return 0;
+	if (hdr->nr_cols == 0)
+		return 1;
+	avail = len - data_offset(hdr->nr_cols);
+	if (hdr->nr_rows > avail / hdr->nr_cols / sizeof(long long))
+		return 0;
+	return hdr->nr_cols * column_size(hdr->nr_rows) <= avail;
+}
+
+struct col_file *
+cols_open(const char *filename)
+{
+	struct cols_header *hdr;
+	struct col_file *cf;
+	struct stat st;
+	unsigned i;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0){
+		perror(filename);
+		exit(1);
+	}
+
+	cf = calloc(1, sizeof(*cf));
+	if (cf == NULL){
+		fprintf(stderr, "column file allocation failed\n");
+		exit(1);
+	}
+
+	cf->map_len = st.st_size;
+	if (cf->map_len < sizeof(*hdr)){
+		fprintf(stderr, "%s: not a column file\n", filename);
+		exit(1);
+	}
+	cf->map = mmap(NULL, cf->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (cf->map == MAP_FAILED){
+		perror("cols_open: mmap");
+		exit(1);
+	}
+	close(fd);
+
+	hdr = cf->map;
+	if (memcmp(hdr->magic, COLS_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    !cols_fit(hdr, cf->map_len)){
+		fprintf(stderr, "%s: not a column file, or truncated\n", filename);
+		exit(1);
+	}
+	cf->nr_cols = hdr->nr_cols;
+	cf->nr_rows = hdr->nr_rows;
+	cf->names = (void *)((char *)cf->map + sizeof(*hdr));
+
+	cf->cols = malloc(cf->nr_cols * sizeof(*cf->cols));
+	if (cf->nr_cols != 0 && cf->cols == NULL){
+		fprintf(stderr, "column file allocation failed\n");
+		exit(1);
+	}
+	for (i = 0; i < cf->nr_cols; i++)
+		cf->cols[i] = (long long *)((char *)cf->map + data_offset(cf->nr_cols) +
+			i * column_size(cf->nr_rows));
+
+	return cf;
+}
+
+long long *
+cols_find(struct col_file *cf, const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < cf->nr_cols; i++)
+		if (strncmp(cf->names[i], name, NODE_NAME_SIZE) == 0)
+			return cf->cols[i];
+
+	return NULL;
+}
+
+void
+cols_close(struct col_file *cf)
+{
+	munmap(cf->map, cf->map_len);
+	free(cf->cols);
+	free(cf);
+}
+
+void
+cols_write(const char *filename, unsigned nr_cols,
+	char (*names)[NODE_NAME_SIZE], long long **cols, unsigned long nr_rows)
+{
+	static const char zeros[COLS_ALIGN];
+	struct cols_header hdr;
+	unsigned long pad;
+	unsigned i;
+	FILE *file;
+
+	file = fopen(filename, "w");
+	if (file == NULL){
+		perror(filename);
+		exit(1);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, COLS_MAGIC, sizeof(hdr.magic));
+	hdr.nr_cols = nr_cols;
+	hdr.nr_rows = nr_rows;
+
+	fwrite(&hdr, sizeof(hdr), 1, file);
+	for (i = 0; i < nr_cols; i++)
+		fwrite(names[i], NODE_NAME_SIZE, 1, file);
+	pad = data_offset(nr_cols) - sizeof(hdr) - nr_cols * NODE_NAME_SIZE;
+	fwrite(zeros, 1, pad, file);
+
+	pad = column_size(nr_rows) - nr_rows * sizeof(long long);
+	for (i = 0; i < nr_cols; i++){
+		fwrite(cols[i], sizeof(long long), nr_rows, file);
+		fwrite(zeros, 1, pad, file);
+	}
+
+	if (ferror(file) || fclose(file) != 0){
+		perror(filename);
+		exit(1);
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef EXPR_COLS_H
+#define EXPR_COLS_H
+
+#include "tree.h"
+
+/******************************************************************************
+ * Data structure definitions
+ */
+
+/*
+ * A columnar file holds nr_cols named columns of nr_rows 64-bit
+ * integers each. On disk it is laid out as:
+ *
+ *    "EXPRCOL1", nr_cols (u32), 0 (u32), nr_rows (u64),
+ *    nr_cols names of NODE_NAME_SIZE bytes,
+ *    the columns one after the other, each starting on a
+ *    COLS_ALIGN boundary, in host byte order.
+ *
+ * Files are mapped, so columns are read in place.
+ */
+#define COLS_MAGIC	"EXPRCOL1"
+#define COLS_ALIGN	64
+
+struct col_file {
+	unsigned	nr_cols;
+	unsigned long	nr_rows;
+	char		(*names)[NODE_NAME_SIZE];
+	long long	**cols;
+
+	void		*map;
+	unsigned long	map_len;
+};
+
+
+/******************************************************************************
+ * Helper Functions
+ */
+
+/* maps a columnar file, exits on errors */
+struct col_file *cols_open(const char *filename);
+
+/* returns the column with this name, or NULL */
+long long *cols_find(struct col_file *cf, const char *name);
+
+void cols_close(struct col_file *cf);
+
+/* writes nr_cols columns of nr_rows values each, exits on errors */
+void cols_write(const char *filename, unsigned nr_cols,
+	char (*names)[NODE_NAME_SIZE], long long **cols, unsigned long nr_rows);
+
+#endif /* EXPR_COLS_H */
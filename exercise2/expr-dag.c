@@ -0,0 +1,282 @@
+/*
+ * expr-dag.c
+ *
+ * Hash-consing of expression trees.
+ *
+ * The tree is walked in post-order. A node is identified by its name
+ * and the ids of its (already unique) children, so looking it up in a
+ * hash table tells whether the same subexpression has been seen
+ * before; if so its id is reused, otherwise a new node is appended.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr.h"
+#include "expr-dag.h"
+
+/* Nodes wider than this keep their child ids on the heap while interned. */
+#define STACK_IDS	64
+
+struct builder {
+	struct expr_dag	*dag;
+	unsigned	nodes_size, edges_size;
+
+	/* open addressing, holds node id + 1, 0 is a free slot */
+	unsigned	*table;
+	unsigned long	table_size;
+};
+
+static void *grow(void *ptr, unsigned *size, unsigned need, size_t elem)
+{
+	if (need <= *size)
+		return ptr;
+
+	while (*size < need)
+		*size = *size ? *size * 2 : 1024;
+	ptr = realloc(ptr, *size * elem);
+	if (ptr == NULL) {
+		fprintf(stderr, "dag allocation failed\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+/*
+ * FNV-1a over the name and the hashes of the children. It depends only
+ * on the subexpression, not on the ids, so hashes can be compared
+ * between the DAGs of different trees.
+ */
+static unsigned long hash_node(struct expr_dag *dag, const char *name,
+	const unsigned *ids, unsigned n)
+{
+	unsigned long h = 14695981039346656037UL;
+	unsigned i;
+
+	for (; *name; name++)
+		h = (h ^ (unsigned char)*name) * 1099511628211UL;
+	for (i = 0; i < n; i++)
+		h = (h ^ dag->nodes[ids[i]].hash) * 1099511628211UL;
+
+	return h;
+}
+
+static int same_node(struct expr_dag *dag, struct dag_node *node,
+	const char *name, const unsigned *ids, unsigned n)
+{
+	return node->nr_children == n &&
+		strcmp(node->name, name) == 0 &&
+		memcmp(dag->edges + node->first, ids, n * sizeof(*ids)) == 0;
+}
+
+static void rehash(struct builder *b)
+{
+	unsigned long i, slot, mask;
+
+	free(b->table);
+	b->table_size = b->table_size ? b->table_size * 2 : 4096;
+	b->table = calloc(b->table_size, sizeof(*b->table));
+	if (b->table == NULL) {
+		fprintf(stderr, "dag allocation failed\n");
+		exit(1);
+	}
+
+	mask = b->table_size - 1;
+	for (i = 0; i < b->dag->nr_nodes; i++) {
+		for (slot = b->dag->nodes[i].hash & mask; b->table[slot]; slot = (slot + 1) & mask)
+			;
+		b->table[slot] = i + 1;
+	}
+}
+
+static unsigned intern(struct builder *b, struct tree_node *tn)
+{
+	struct expr_dag *dag = b->dag;
+	unsigned stack_ids[STACK_IDS], *ids = stack_ids;
+	unsigned n = tn->nr_children, i, id;
+	unsigned long h, slot, mask, size = 1;
+	struct dag_node *node;
+
+	if (n > STACK_IDS) {
+		ids = malloc(n * sizeof(*ids));
+		if (ids == NULL) {
+			fprintf(stderr, "dag allocation failed\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		ids[i] = intern(b, tn->children + i);
+		size += dag->nodes[ids[i]].size;
+		if (size < dag->nodes[ids[i]].size)
+			size = -1UL;	/* saturate, shared subtrees can blow up */
+	}
+
+	h = hash_node(dag, tn->name, ids, n);
+	mask = b->table_size - 1;
+	for (slot = h & mask; b->table[slot]; slot = (slot + 1) & mask) {
+		node = &dag->nodes[b->table[slot] - 1];
+		if (node->hash == h && same_node(dag, node, tn->name, ids, n)) {
+			id = b->table[slot] - 1;
+			goto out;
+		}
+	}
+
+	/* a new subexpression */
+	id = dag->nr_nodes;
+	dag->nodes = grow(dag->nodes, &b->nodes_size, id + 1, sizeof(*dag->nodes));
+	dag->edges = grow(dag->edges, &b->edges_size, dag->nr_edges + n, sizeof(*dag->edges));
+
+	node = &dag->nodes[id];
+	memcpy(node->name, tn->name, NODE_NAME_SIZE);
+	node->op = expr_op_of(tn);
+	node->is_var = node->op == EXPR_VAL && expr_leaf_is_var(tn);
+	node->val = node->op == EXPR_VAL && !node->is_var ? expr_leaf_value(tn) : 0;
+	node->nr_children = n;
+	node->first = dag->nr_edges;
+	node->refs = 0;
+	node->size = size;
+	node->hash = h;
+	for (i = 0; i < n; i++) {
+		dag->edges[dag->nr_edges++] = ids[i];
+		dag->nodes[ids[i]].refs++;
+	}
+	dag->nr_nodes++;
+
+	b->table[slot] = id + 1;
+	if (2 * dag->nr_nodes > b->table_size)
+		rehash(b);
+out:
+	if (ids != stack_ids)
+		free(ids);
+	return id;
+}
+
+struct expr_dag *
+expr_dag_build(struct tree_node *root)
+{
+	struct builder b;
+
+	memset(&b, 0, sizeof(b));
+	b.dag = calloc(1, sizeof(*b.dag));
+	if (b.dag == NULL) {
+		fprintf(stderr, "dag allocation failed\n");
+		exit(1);
+	}
+	rehash(&b);
+
+	b.dag->root = intern(&b, root);
+	b.dag->tree_nodes = expr_count_nodes(root, -1UL);
+
+	free(b.table);
+	return b.dag;
+}
+
+long long
+expr_dag_eval(const struct expr_dag *dag)
+{
+	const struct dag_node *node;
+	long long *vals, result;
+	unsigned i, j;
+
+	vals = malloc(dag->nr_nodes * sizeof(*vals));
+	if (vals == NULL) {
+		fprintf(stderr, "dag allocation failed\n");
+		exit(1);
+	}
+
+	for (i = 0; i < dag->nr_nodes; i++) {
+		node = &dag->nodes[i];
+		if (node->op == EXPR_VAL) {
+			vals[i] = node->val;
+			continue;
+		}
+		vals[i] = vals[dag->edges[node->first]];
+		if (node->op == EXPR_SUB && node->nr_children == 1)
+			vals[i] = expr_apply(node->op, 0, vals[i]);
+		for (j = 1; j < node->nr_children; j++)
+			vals[i] = expr_apply(node->op, vals[i], vals[dag->edges[node->first + j]]);
+	}
+
+	result = vals[dag->root];
+	free(vals);
+	return result;
+}
+
+unsigned
+expr_dag_eval_incremental(const struct expr_dag *dag, long long *vals,
+	const struct expr_dag *prev, const long long *prev_vals)
+{
+	const struct dag_node *node, *old;
+	unsigned *table = NULL, *match;
+	unsigned long table_size = 1, slot, mask;
+	unsigned i, j, nr_evaluated = 0;
+
+	/* match[i] is the node of prev with the same subexpression, + 1 */
+	match = calloc(dag->nr_nodes, sizeof(*match));
+	if (prev != NULL) {
+		while (table_size < 2 * prev->nr_nodes)
+			table_size *= 2;
+		table = calloc(table_size, sizeof(*table));
+	}
+	if (match == NULL || (prev != NULL && table == NULL)) {
+		fprintf(stderr, "dag allocation failed\n");
+		exit(1);
+	}
+	mask = table_size - 1;
+	for (i = 0; prev != NULL && i < prev->nr_nodes; i++) {
+		for (slot = prev->nodes[i].hash & mask; table[slot]; slot = (slot + 1) & mask)
+			;
+		table[slot] = i + 1;
+	}
+
+	for (i = 0; i < dag->nr_nodes; i++) {
+		node = &dag->nodes[i];
+
+		/*
+		 * The children have been matched already, so a node is the
+		 * same as an old one if its name is and its children are.
+		 */
+		for (slot = node->hash & mask; table != NULL && table[slot]; slot = (slot + 1) & mask) {
+			old = &prev->nodes[table[slot] - 1];
+			if (old->hash != node->hash || old->nr_children != node->nr_children ||
+			    strcmp(old->name, node->name) != 0)
+				continue;
+			for (j = 0; j < node->nr_children; j++)
+				if (match[dag->edges[node->first + j]] != prev->edges[old->first + j] + 1)
+					break;
+			if (j == node->nr_children) {
+				match[i] = table[slot];
+				break;
+			}
+		}
+		if (match[i]) {
+			vals[i] = prev_vals[match[i] - 1];
+			continue;
+		}
+
+		/* changed, or above a change */
+		nr_evaluated++;
+		if (node->op == EXPR_VAL) {
+			vals[i] = node->val;
+			continue;
+		}
+		vals[i] = vals[dag->edges[node->first]];
+		if (node->op == EXPR_SUB && node->nr_children == 1)
+			vals[i] = expr_apply(node->op, 0, vals[i]);
+		for (j = 1; j < node->nr_children; j++)
+			vals[i] = expr_apply(node->op, vals[i], vals[dag->edges[node->first + j]]);
+	}
+
+	free(table);
+	free(match);
+	return nr_evaluated;
+}
+
+void
+expr_dag_free(struct expr_dag *dag)
+{
+	free(dag->nodes);
+	free(dag->edges);
+	free(dag);
+}
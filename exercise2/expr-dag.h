@@ -0,0 +1,61 @@
+#ifndef EXPR_DAG_H
+#define EXPR_DAG_H
+
+#include "tree.h"
+
+/******************************************************************************
+ * Data structure definitions
+ */
+
+/*
+ * An expression tree with structurally identical subtrees merged
+ * (hash-consed), which makes it a DAG. Every unique subexpression
+ * is one node, no matter how many times it appears in the tree.
+ */
+struct dag_node {
+	char		name[NODE_NAME_SIZE];
+	int		op;		/* enum expr_op */
+	int		is_var;		/* leaf that is a variable */
+	long long	val;		/* value of a literal leaf */
+	unsigned	nr_children;
+	unsigned	first;		/* children are edges[first .. first + nr_children) */
+	unsigned	refs;		/* number of edges pointing to this node */
+	unsigned long	size;		/* nodes of the subtree it stands for */
+	unsigned long	hash;		/* of the subexpression, equal in every DAG */
+};
+
+struct expr_dag {
+	/* children come before their parents, the root is last */
+	struct dag_node	*nodes;
+	unsigned	nr_nodes;
+	unsigned	*edges;		/* node ids */
+	unsigned	nr_edges;
+	unsigned	root;
+
+	unsigned long	tree_nodes;	/* nodes of the tree it was built from */
+};
+
+
+/******************************************************************************
+ * Helper Functions
+ */
+
+/* builds the DAG of an expression tree, exits on errors */
+struct expr_dag *expr_dag_build(struct tree_node *root);
+
+/* evaluates every node once, in order, in the calling process */
+long long expr_dag_eval(const struct expr_dag *dag);
+
+/*
+ * Evaluates every node of a DAG into vals, reusing the values of an
+ * earlier version of it: a node whose subexpression is also in prev
+ * takes its value from prev_vals, so only the changed subexpressions
+ * and the ones above them are evaluated. prev may be NULL.
+ * Returns the number of nodes evaluated.
+ */
+unsigned expr_dag_eval_incremental(const struct expr_dag *dag, long long *vals,
+	const struct expr_dag *prev, const long long *prev_vals);
+
+void expr_dag_free(struct expr_dag *dag);
+
+#endif /* EXPR_DAG_H */
@@ -0,0 +1,417 @@
+/*
+ * expr-pool.c
+ *
+ * Evaluates an expression tree on a pool of pre-forked worker processes.
+ *
+ * The workers are forked once, after the tree has been parsed, so each
+ * one has its own copy of the tree and a node can be named by its id.
+ * Nodes are numbered in BFS order, which keeps the children of a node
+ * next to each other, and their values live in a shared array.
+ *
+ * The calling process is the coordinator: it queues a task (a node id)
+ * as soon as the values of all of the node's children are in, and a
+ * worker folds those values into the node's own. Tasks and results go
+ * through two rings in shared memory, guarded by process-shared
+ * semaphores, so no process is created per node while evaluating.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "expr.h"
+#include "expr-pool.h"
+#include "proc-common.h"
+
+/* capacity of the task and the result ring */
+#define POOL_QUEUE	1024
+
+/* how often the coordinator checks for dead workers while waiting */
+#define POOL_CHECK_MS	100
+
+enum pool_kind {
+	POOL_LEAF,	/* value known up front */
+	POOL_SUBTREE,	/* small subtree, evaluated by one task */
+	POOL_INNER,	/* one task, after its children */
+};
+
+struct pool_task {
+	int		node;		/* -1 tells the worker to exit */
+	double		queued_ms;
+};
+
+struct pool_result {
+	int		node;
+	double		queued_ms;
+	double		started_ms;
+};
+
+/* everything the coordinator and the workers share, but the values */
+struct pool_shared {
+	sem_t			tasks_full;	/* tasks queued and not taken yet */
+	sem_t			tasks_free;	/* task slots read, or never used */
+	sem_t			results_full;	/* results not read yet */
+	sem_t			results_lock;	/* between the workers */
+
+	unsigned long		task_head;	/* taken with an atomic add */
+	unsigned long		task_tail;
+	unsigned long		result_head;
+	unsigned long		result_tail;
+
+	struct pool_task	tasks[POOL_QUEUE];
+	struct pool_result	results[POOL_QUEUE];
+};
+
+struct expr_pool {
+	struct pool_shared	*shm;
+	long long		*vals;		/* shared, one per node */
+
+	/* the tree in BFS order, the same in every process */
+	struct tree_node	**nodes;
+	unsigned		*first;		/* id of the first child */
+	unsigned		*parent;
+	unsigned char		*kind;
+	unsigned		nr_nodes;
+	unsigned long		vals_size;	/* nodes in the tree */
+
+	/* coordinator only */
+	unsigned		*pending;	/* children not done yet */
+	unsigned		*ready;
+	double			*latency_us;
+
+	pid_t			*pids;
+	int			nr_procs;
+};
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void sem_wait_intr(sem_t *sem)
+{
+	while (sem_wait(sem) < 0) {
+		if (errno != EINTR) {
+			perror("sem_wait");
+			exit(1);
+		}
+	}
+}
+
+static void *pool_alloc(size_t size)
+{
+	void *ptr = malloc(size ? size : 1);
+
+	if (ptr == NULL) {
+		fprintf(stderr, "expr_pool: out of memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+/******************************************************************************
+ * Worker side
+ */
+
+static void run_task(struct expr_pool *pool, int id)
+{
+	struct tree_node *node = pool->nodes[id];
+
+	if (pool->kind[id] == POOL_SUBTREE)
+		pool->vals[id] = expr_eval(node);
+	else
+		pool->vals[id] = expr_fold(expr_op_of(node),
+			&pool->vals[pool->first[id]], node->nr_children);
+}
+
+static void worker_main(struct expr_pool *pool, int nr)
+{
+	struct pool_shared *shm = pool->shm;
+	struct pool_task task;
+	struct pool_result *res;
+	char name[NODE_NAME_SIZE];
+	double started;
+
+	snprintf(name, sizeof(name), "pool-%d", nr);
+	change_pname(name);
+
+	for (;;) {
+		sem_wait_intr(&shm->tasks_full);
+		task = shm->tasks[__atomic_fetch_add(&shm->task_head, 1, __ATOMIC_ACQ_REL) % POOL_QUEUE];
+		sem_post(&shm->tasks_free);
+		if (task.node < 0)
+			exit(0);
+
+		started = now_ms();
+		run_task(pool, task.node);
+
+		sem_wait_intr(&shm->results_lock);
+		res = &shm->results[shm->result_tail++ % POOL_QUEUE];
+		res->node = task.node;
+		res->queued_ms = task.queued_ms;
+		res->started_ms = started;
+		sem_post(&shm->results_lock);
+		sem_post(&shm->results_full);
+	}
+}
+
+/******************************************************************************
+ * Coordinator side
+ */
+
+/*
+ * A worker may take a slot and be preempted before it reads the task out
+ * of it, while others return results, so the results in flight say nothing
+ * about which slots are free: wait until the slot has been read.
+ */
+static void queue_task(struct expr_pool *pool, int id)
+{
+	struct pool_shared *shm = pool->shm;
+	struct pool_task *task;
+
+	sem_wait_intr(&shm->tasks_free);
+	task = &shm->tasks[shm->task_tail++ % POOL_QUEUE];
+	task->node = id;
+	task->queued_ms = now_ms();
+	sem_post(&shm->tasks_full);
+}
+
+/* A dead worker would never return its task, so do not wait forever. */
+static void check_workers(struct expr_pool *pool)
+{
+	int i, status;
+
+	for (i = 0; i < pool->nr_procs; i++) {
+		if (waitpid(pool->pids[i], &status, WNOHANG) > 0) {
+			fprintf(stderr, "expr_pool: worker %d died\n", i);
+			explain_wait_status(pool->pids[i], status);
+			exit(1);
+		}
+	}
+}
+
+static struct pool_result wait_result(struct expr_pool *pool)
+{
+	struct pool_shared *shm = pool->shm;
+	struct timespec ts;
+
+	for (;;) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += POOL_CHECK_MS * 1000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+		if (sem_timedwait(&shm->results_full, &ts) == 0)
+			break;
+		if (errno == ETIMEDOUT)
+			check_workers(pool);
+		else if (errno != EINTR) {
+			perror("sem_timedwait");
+			exit(1);
+		}
+	}
+
+	return shm->results[shm->result_head++ % POOL_QUEUE];
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void fill_stats(struct pool_stats *stats, double *lat, unsigned long n)
+{
+	unsigned long i;
+	double sum = 0;
+
+	stats->nr_tasks = n;
+	if (n == 0) {
+		stats->mean_us = stats->p50_us = stats->p99_us = stats->max_us = 0;
+		return;
+	}
+	qsort(lat, n, sizeof(*lat), cmp_double);
+	for (i = 0; i < n; i++)
+		sum += lat[i];
+	stats->mean_us = sum / n;
+	stats->p50_us = lat[n / 2];
+	stats->p99_us = lat[n * 99 / 100];
+	stats->max_us = lat[n - 1];
+}
+
+long long
+expr_pool_eval(struct expr_pool *pool, struct pool_stats *stats)
+{
+	struct tree_node *node;
+	struct pool_result res;
+	unsigned long nr_tasks = 0, in_flight = 0;
+	unsigned i, j, nr_ready = 0, p;
+
+	if (pool->kind[0] == POOL_LEAF) {
+		if (stats != NULL)
+			fill_stats(stats, pool->latency_us, 0);
+		return pool->vals[0];
+	}
+
+	for (i = 0; i < pool->nr_nodes; i++) {
+		pool->pending[i] = 0;
+		if (pool->kind[i] == POOL_LEAF)
+			continue;
+		node = pool->nodes[i];
+		for (j = 0; pool->kind[i] == POOL_INNER && j < node->nr_children; j++)
+			if (pool->kind[pool->first[i] + j] != POOL_LEAF)
+				pool->pending[i]++;
+		if (pool->pending[i] == 0)
+			pool->ready[nr_ready++] = i;
+	}
+
+	/*
+	 * At most POOL_QUEUE tasks are in flight, so the result ring cannot
+	 * overflow and the workers never wait for room for a result.
+	 */
+	for (;;) {
+		while (nr_ready > 0 && in_flight < POOL_QUEUE) {
+			queue_task(pool, pool->ready[--nr_ready]);
+			in_flight++;
+		}
+
+		res = wait_result(pool);
+		in_flight--;
+		pool->latency_us[nr_tasks++] = (res.started_ms - res.queued_ms) * 1e3;
+		if (res.node == 0)
+			break;
+
+		p = pool->parent[res.node];
+		if (--pool->pending[p] == 0)
+			pool->ready[nr_ready++] = p;
+	}
+
+	if (stats != NULL)
+		fill_stats(stats, pool->latency_us, nr_tasks);
+	return pool->vals[0];
+}
+
+static enum pool_kind kind_of(struct tree_node *node, unsigned long cutoff_size)
+{
+	if (node->nr_children == 0)
+		return POOL_LEAF;
+	if (cutoff_size != 0 && expr_count_nodes(node, cutoff_size) <= cutoff_size)
+		return POOL_SUBTREE;
+	return POOL_INNER;
+}
+
+struct expr_pool *
+expr_pool_create(struct tree_node *root, int nprocs, unsigned long cutoff_size)
+{
+	struct expr_pool *pool;
+	struct tree_node *node;
+	unsigned long total;
+	unsigned i, j, n;
+	pid_t pid;
+
+	if (nprocs <= 0)
+		nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nprocs <= 0)
+		nprocs = 1;
+	if (nprocs > POOL_QUEUE)
+		nprocs = POOL_QUEUE;
+
+	total = expr_count_nodes(root, -1UL);
+	pool = pool_alloc(sizeof(*pool));
+	pool->nodes = pool_alloc(total * sizeof(*pool->nodes));
+	pool->first = pool_alloc(total * sizeof(*pool->first));
+	pool->parent = pool_alloc(total * sizeof(*pool->parent));
+	pool->kind = pool_alloc(total * sizeof(*pool->kind));
+	pool->pending = pool_alloc(total * sizeof(*pool->pending));
+	pool->ready = pool_alloc(total * sizeof(*pool->ready));
+	pool->latency_us = pool_alloc(total * sizeof(*pool->latency_us));
+	pool->pids = pool_alloc(nprocs * sizeof(*pool->pids));
+	pool->vals = create_shared_memory_area(total * sizeof(*pool->vals));
+	pool->vals_size = total;
+	pool->shm = create_shared_memory_area(sizeof(*pool->shm));
+
+	/* number the nodes, small subtrees are not descended into */
+	pool->nodes[0] = root;
+	pool->parent[0] = 0;
+	pool->kind[0] = kind_of(root, cutoff_size);
+	n = 1;
+	for (i = 0; i < n; i++) {
+		node = pool->nodes[i];
+		pool->first[i] = n;
+		if (pool->kind[i] == POOL_LEAF)
+			pool->vals[i] = expr_leaf_value(node);
+		if (pool->kind[i] != POOL_INNER)
+			continue;
+		for (j = 0; j < node->nr_children; j++, n++) {
+			pool->nodes[n] = node->children + j;
+			pool->parent[n] = i;
+			pool->kind[n] = kind_of(node->children + j, cutoff_size);
+		}
+	}
+	pool->nr_nodes = n;
+
+	if (sem_init(&pool->shm->tasks_full, 1, 0) < 0 ||
+	    sem_init(&pool->shm->tasks_free, 1, POOL_QUEUE) < 0 ||
+	    sem_init(&pool->shm->results_full, 1, 0) < 0 ||
+	    sem_init(&pool->shm->results_lock, 1, 1) < 0) {
+		perror("sem_init");
+		exit(1);
+	}
+
+	fflush(stdout);
+	for (pool->nr_procs = 0; pool->nr_procs < nprocs; pool->nr_procs++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("expr_pool_create: fork");
+			exit(1);
+		}
+		if (pid == 0)
+			worker_main(pool, pool->nr_procs);
+		pool->pids[pool->nr_procs] = pid;
+	}
+
+	return pool;
+}
+
+int
+expr_pool_size(const struct expr_pool *pool)
+{
+	return pool->nr_procs;
+}
+
+void
+expr_pool_destroy(struct expr_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->nr_procs; i++)
+		queue_task(pool, -1);
+	for (i = 0; i < pool->nr_procs; i++)
+		waitpid(pool->pids[i], NULL, 0);
+
+	sem_destroy(&pool->shm->tasks_full);
+	sem_destroy(&pool->shm->tasks_free);
+	sem_destroy(&pool->shm->results_full);
+	sem_destroy(&pool->shm->results_lock);
+	munmap(pool->shm, sizeof(*pool->shm));
+	munmap(pool->vals, pool->vals_size * sizeof(*pool->vals));
+
+	free(pool->nodes);
+	free(pool->first);
+	free(pool->parent);
+	free(pool->kind);
+	free(pool->pending);
+	free(pool->ready);
+	free(pool->latency_us);
+	free(pool->pids);
+	free(pool);
+}
@@ -0,0 +1,49 @@
+#ifndef EXPR_POOL_H
+#define EXPR_POOL_H
+
+#include "tree.h"
+
+/******************************************************************************
+ * Data structure definitions
+ */
+
+struct expr_pool;
+
+/* dispatch latency: from queueing a task until a worker starts it */
+struct pool_stats {
+	unsigned long	nr_tasks;
+	double		mean_us;
+	double		p50_us;
+	double		p99_us;
+	double		max_us;
+};
+
+
+/******************************************************************************
+ * Helper Functions
+ */
+
+/*
+ * Forks nprocs worker processes for a tree (nprocs <= 0: one per
+ * online CPU). Subtrees of at most cutoff_size nodes are evaluated by
+ * a worker as a single task, zero makes every inner node a task.
+ * The workers share the tree with the caller, so it must not change
+ * until expr_pool_destroy().
+ */
+struct expr_pool *expr_pool_create(struct tree_node *root, int nprocs,
+	unsigned long cutoff_size);
+
+/* returns the number of worker processes */
+int expr_pool_size(const struct expr_pool *pool);
+
+/*
+ * Evaluates the tree on the pool, the calling process only hands out
+ * the tasks whose operands are ready. stats may be NULL.
+ * Exits if a worker dies.
+ */
+long long expr_pool_eval(struct expr_pool *pool, struct pool_stats *stats);
+
+/* stops the workers and waits for them */
+void expr_pool_destroy(struct expr_pool *pool);
+
+#endif /* EXPR_POOL_H */
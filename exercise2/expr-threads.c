@@ -0,0 +1,495 @@
+/*
+ * expr-threads.c
+ *
+ * Evaluates an expression tree on a fixed pool of threads,
+ * without creating any processes.
+ *
+ * Every worker owns a Chase-Lev deque of tasks. A worker evaluating a
+ * node pushes its inner children onto the bottom of its own deque,
+ * evaluates the first child itself, and then joins the rest: children
+ * still in the deque are popped back and evaluated in place, children
+ * stolen by other workers are waited for while stealing more work.
+ * Idle workers steal from the top of a random victim's deque, so they
+ * always get the oldest, i.e. biggest, subtrees.
+ *
+ * A hash-consed DAG cannot be joined like this, as a shared node would be
+ * waited for from several places. It is evaluated as a dataflow graph
+ * instead: every node counts its children that are not done yet, and the
+ * worker that completes the last child of a node pushes it to its deque.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "expr.h"
+#include "expr-dag.h"
+#include "expr-threads.h"
+
+/*
+ * POSIX thread functions do not return error numbers in errno,
+ * but in the actual return value of the function call instead.
+ * This macro helps with error reporting in this case.
+ */
+#define perror_pthread(ret, msg) \
+	do { errno = ret; perror(msg); } while (0)
+
+/* Deque capacity, a power of two. When full, children are evaluated inline. */
+#define WSQ_SIZE	4096
+
+/* Children of nodes wider than this keep their tasks on the heap. */
+#define STACK_TASKS	64
+
+/* Initially ready DAG nodes are handed out in chunks of this many. */
+#define READY_CHUNK	64
+
+#define CACHE_LINE	64
+
+struct task {
+	struct tree_node *node;
+	long long value;
+	int pushed;
+	atomic_int done;
+};
+
+/* State of a DAG evaluation, shared by all workers */
+struct dag_eval {
+	const struct expr_dag *dag;
+	long long *vals;
+	atomic_uint *pending;		/* children not done yet */
+	unsigned *parents;		/* parents of node i are parents[parent_first[i] ..] */
+	unsigned *parent_first;		/* nr_nodes + 1 entries */
+	unsigned *ready;		/* nodes with no pending children at the start */
+	unsigned nr_ready;
+	atomic_uint next_ready;
+};
+
+/*
+ * Deque entries are struct task pointers when evaluating
+ * a tree, and struct dag_node pointers for a DAG.
+ */
+struct worker {
+	/* top is written by thieves, bottom only by the owner */
+	_Alignas(CACHE_LINE) atomic_long top;
+	_Alignas(CACHE_LINE) atomic_long bottom;
+	_Atomic(void *) buf[WSQ_SIZE];
+
+	struct pool *pool;
+	unsigned seed;
+	pthread_t tid;
+};
+
+struct pool {
+	struct worker *workers;
+	int nr_workers;
+	atomic_int finished;
+	struct dag_eval *dag;		/* NULL for a tree */
+};
+
+/******************************************************************************
+ * Chase-Lev work-stealing deque, as in "Correct and Efficient Work-Stealing
+ * for Weak Memory Models" (Le et al., PPoPP 2013), with a fixed-size buffer.
+ */
+
+static int wsq_push(struct worker *w, void *t)
+{
+	long b = atomic_load_explicit(&w->bottom, memory_order_relaxed);
+	long top = atomic_load_explicit(&w->top, memory_order_acquire);
+
+	if (b - top >= WSQ_SIZE)
+		return 0;
+
+	atomic_store_explicit(&w->buf[b & (WSQ_SIZE - 1)], t, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+	return 1;
+}
+
+/* Owner side: pop from the bottom. */
+static void *wsq_take(struct worker *w)
+{
+	long b = atomic_load_explicit(&w->bottom, memory_order_relaxed) - 1;
+	long top;
+	void *t;
+
+	atomic_store_explicit(&w->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	top = atomic_load_explicit(&w->top, memory_order_relaxed);
+
+	if (top > b) {
+		/* empty */
+		atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	t = atomic_load_explicit(&w->buf[b & (WSQ_SIZE - 1)], memory_order_relaxed);
+	if (top == b) {
+		/* last task, race against thieves for it */
+		if (!atomic_compare_exchange_strong_explicit(&w->top, &top, top + 1,
+				memory_order_seq_cst, memory_order_relaxed))
+			t = NULL;
+		atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+	}
+	return t;
+}
+
+/* Thief side: pop from the top. Returns NULL if empty or on a lost race. */
+static void *wsq_steal(struct worker *w)
+{
+	long top = atomic_load_explicit(&w->top, memory_order_acquire);
+	long b;
+	void *t;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	b = atomic_load_explicit(&w->bottom, memory_order_acquire);
+	if (top >= b)
+		return NULL;
+
+	t = atomic_load_explicit(&w->buf[top & (WSQ_SIZE - 1)], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&w->top, &top, top + 1,
+			memory_order_seq_cst, memory_order_relaxed))
+		return NULL;
+	return t;
+}
+
+/******************************************************************************
+ * Evaluation
+ */
+
+static void *steal_one(struct worker *self)
+{
+	struct pool *pool = self->pool;
+	void *t;
+	int i, victim;
+
+	if (pool->nr_workers == 1)
+		return NULL;
+
+	/* xorshift, to spread thieves over victims */
+	self->seed ^= self->seed << 13;
+	self->seed ^= self->seed >> 17;
+	self->seed ^= self->seed << 5;
+	victim = self->seed % pool->nr_workers;
+
+	for (i = 0; i < pool->nr_workers; i++, victim = (victim + 1) % pool->nr_workers) {
+		if (&pool->workers[victim] == self)
+			continue;
+		t = wsq_steal(&pool->workers[victim]);
+		if (t != NULL)
+			return t;
+	}
+	return NULL;
+}
+
+static long long eval_node(struct worker *w, struct tree_node *node);
+
+static void run_task(struct worker *w, struct task *t)
+{
+	t->value = eval_node(w, t->node);
+	atomic_store_explicit(&t->done, 1, memory_order_release);
+}
+
+/* Wait for a stolen task, stealing other work in the meantime. */
+static void join_task(struct worker *w, struct task *t)
+{
+	struct task *other;
+
+	while (!atomic_load_explicit(&t->done, memory_order_acquire)) {
+		other = wsq_take(w);
+		if (other == NULL)
+			other = steal_one(w);
+		if (other != NULL)
+			run_task(w, other);
+		else
+			sched_yield();
+	}
+}
+
+static long long eval_node(struct worker *w, struct tree_node *node)
+{
+	enum expr_op op = expr_op_of(node);
+	unsigned n = node->nr_children, i;
+	long long result;
+
+	if (n == 0)
+		return expr_leaf_value(node);
+
+	struct task stack_tasks[n <= STACK_TASKS ? n : 1], *tasks = stack_tasks;
+
+	if (n > STACK_TASKS) {
+		tasks = malloc(n * sizeof(*tasks));
+		if (tasks == NULL) {
+			fprintf(stderr, "eval_node: out of memory\n");
+			exit(1);
+		}
+	}
+
+	/* Leaves are cheaper to evaluate than to push, keep them here */
+	for (i = 0; i < n; i++) {
+		tasks[i].node = node->children + i;
+		tasks[i].pushed = 0;
+		atomic_init(&tasks[i].done, 0);
+		if (i > 0 && tasks[i].node->nr_children != 0)
+			tasks[i].pushed = wsq_push(w, &tasks[i]);
+	}
+
+	for (i = 0; i < n; i++)
+		if (!tasks[i].pushed)
+			run_task(w, &tasks[i]);
+
+	/* Join in reverse order of pushing, so that take() finds them first */
+	for (i = n; i-- > 0; )
+		if (tasks[i].pushed)
+			join_task(w, &tasks[i]);
+
+	/* Same fold as expr_fold(), in index order */
+	result = tasks[0].value;
+	if (op == EXPR_SUB && n == 1)
+		result = expr_apply(op, 0, result);
+	for (i = 1; i < n; i++)
+		result = expr_apply(op, result, tasks[i].value);
+
+	if (tasks != stack_tasks)
+		free(tasks);
+	return result;
+}
+
+/******************************************************************************
+ * DAG evaluation
+ */
+
+static void run_dag_node(struct worker *w, const struct dag_node *node)
+{
+	struct dag_eval *de = w->pool->dag;
+	const struct expr_dag *dag = de->dag;
+	unsigned id = node - dag->nodes, i, p;
+	long long val;
+
+	/* all children are done, fold them in index order */
+	val = de->vals[dag->edges[node->first]];
+	if (node->op == EXPR_SUB && node->nr_children == 1)
+		val = expr_apply(node->op, 0, val);
+	for (i = 1; i < node->nr_children; i++)
+		val = expr_apply(node->op, val, de->vals[dag->edges[node->first + i]]);
+	de->vals[id] = val;
+
+	if (id == dag->root) {
+		atomic_store_explicit(&w->pool->finished, 1, memory_order_release);
+		return;
+	}
+
+	for (i = de->parent_first[id]; i < de->parent_first[id + 1]; i++) {
+		p = de->parents[i];
+		if (atomic_fetch_sub_explicit(&de->pending[p], 1, memory_order_acq_rel) != 1)
+			continue;
+		/* this was the last child, the parent is ready */
+		if (!wsq_push(w, &dag->nodes[p]))
+			run_dag_node(w, &dag->nodes[p]);
+	}
+}
+
+static void dag_worker_loop(struct worker *w)
+{
+	struct dag_eval *de = w->pool->dag;
+	const struct dag_node *node;
+	unsigned start, end;
+
+	while (!atomic_load_explicit(&w->pool->finished, memory_order_acquire)) {
+		node = wsq_take(w);
+		if (node != NULL) {
+			run_dag_node(w, node);
+			continue;
+		}
+
+		/*
+		 * Only add while there are ready nodes left, so that idle
+		 * spins cannot wrap the counter around to nodes already run.
+		 */
+		start = atomic_load_explicit(&de->next_ready, memory_order_relaxed);
+		if (start < de->nr_ready)
+			start = atomic_fetch_add_explicit(&de->next_ready, READY_CHUNK,
+				memory_order_relaxed);
+		if (start < de->nr_ready) {
+			end = start + READY_CHUNK < de->nr_ready ? start + READY_CHUNK : de->nr_ready;
+			for (; start < end; start++)
+				run_dag_node(w, &de->dag->nodes[de->ready[start]]);
+			continue;
+		}
+
+		node = steal_one(w);
+		if (node != NULL)
+			run_dag_node(w, node);
+		else
+			sched_yield();
+	}
+}
+
+/*
+ * Leaves are known up front, so only inner children are pending, and
+ * the inner nodes whose children are all leaves are the initial work.
+ */
+static struct dag_eval *dag_eval_init(const struct expr_dag *dag)
+{
+	struct dag_eval *de;
+	const struct dag_node *node;
+	unsigned i, j, child;
+
+	de = calloc(1, sizeof(*de));
+	if (de != NULL) {
+		de->dag = dag;
+		de->vals = malloc(dag->nr_nodes * sizeof(*de->vals));
+		de->pending = malloc(dag->nr_nodes * sizeof(*de->pending));
+		de->parents = malloc((dag->nr_edges + 1) * sizeof(*de->parents));
+		de->parent_first = calloc(dag->nr_nodes + 1, sizeof(*de->parent_first));
+		de->ready = malloc(dag->nr_nodes * sizeof(*de->ready));
+	}
+	if (de == NULL || de->vals == NULL || de->pending == NULL || de->parents == NULL ||
+	    de->parent_first == NULL || de->ready == NULL) {
+		fprintf(stderr, "dag_eval_init: out of memory\n");
+		exit(1);
+	}
+
+	/* reverse the edges, counting sort by child */
+	for (i = 0; i < dag->nr_edges; i++)
+		de->parent_first[dag->edges[i] + 1]++;
+	for (i = 0; i < dag->nr_nodes; i++)
+		de->parent_first[i + 1] += de->parent_first[i];
+
+	for (i = 0; i < dag->nr_nodes; i++) {
+		node = &dag->nodes[i];
+		de->vals[i] = node->val;
+		atomic_init(&de->pending[i], 0);
+		for (j = 0; j < node->nr_children; j++) {
+			child = dag->edges[node->first + j];
+			/* parent_first[child] is used as a cursor here, restored below */
+			de->parents[de->parent_first[child]++] = i;
+			if (dag->nodes[child].op != EXPR_VAL)
+				atomic_fetch_add_explicit(&de->pending[i], 1, memory_order_relaxed);
+		}
+		if (node->op != EXPR_VAL &&
+		    atomic_load_explicit(&de->pending[i], memory_order_relaxed) == 0)
+			de->ready[de->nr_ready++] = i;
+	}
+	for (i = dag->nr_nodes; i > 0; i--)
+		de->parent_first[i] = de->parent_first[i - 1];
+	de->parent_first[0] = 0;
+	atomic_init(&de->next_ready, 0);
+
+	return de;
+}
+
+static void dag_eval_free(struct dag_eval *de)
+{
+	free(de->vals);
+	free((void *)de->pending);
+	free(de->parents);
+	free(de->parent_first);
+	free(de->ready);
+	free(de);
+}
+
+/******************************************************************************
+ * The pool
+ */
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct task *t;
+
+	if (w->pool->dag != NULL) {
+		dag_worker_loop(w);
+		return NULL;
+	}
+
+	while (!atomic_load_explicit(&w->pool->finished, memory_order_acquire)) {
+		t = steal_one(w);
+		if (t != NULL)
+			run_task(w, t);
+		else
+			sched_yield();
+	}
+	return NULL;
+}
+
+/* Starts nthreads - 1 threads, the calling thread is worker 0 */
+static void pool_start(struct pool *pool, int nthreads, struct dag_eval *dag)
+{
+	int i, ret;
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	pool->nr_workers = nthreads;
+	pool->dag = dag;
+	atomic_init(&pool->finished, 0);
+	pool->workers = aligned_alloc(CACHE_LINE, nthreads * sizeof(struct worker));
+	if (pool->workers == NULL) {
+		fprintf(stderr, "pool_start: out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < nthreads; i++) {
+		atomic_init(&pool->workers[i].top, 0);
+		atomic_init(&pool->workers[i].bottom, 0);
+		pool->workers[i].pool = pool;
+		pool->workers[i].seed = 2463534242u + i;
+	}
+
+	for (i = 1; i < nthreads; i++) {
+		ret = pthread_create(&pool->workers[i].tid, NULL, worker_main, &pool->workers[i]);
+		if (ret) {
+			perror_pthread(ret, "pthread_create");
+			exit(1);
+		}
+	}
+}
+
+static void pool_stop(struct pool *pool)
+{
+	int i, ret;
+
+	atomic_store_explicit(&pool->finished, 1, memory_order_release);
+	for (i = 1; i < pool->nr_workers; i++) {
+		ret = pthread_join(pool->workers[i].tid, NULL);
+		if (ret)
+			perror_pthread(ret, "pthread_join");
+	}
+	free(pool->workers);
+}
+
+long long expr_threads_eval(struct tree_node *root, int nthreads)
+{
+	struct pool pool;
+	long long result;
+
+	pool_start(&pool, nthreads, NULL);
+	result = eval_node(&pool.workers[0], root);
+	pool_stop(&pool);
+
+	return result;
+}
+
+long long expr_threads_eval_dag(const struct expr_dag *dag, int nthreads)
+{
+	struct dag_eval *de;
+	struct pool pool;
+	long long result;
+
+	if (dag->nodes[dag->root].op == EXPR_VAL)
+		return dag->nodes[dag->root].val;
+
+	de = dag_eval_init(dag);
+	pool_start(&pool, nthreads, de);
+	dag_worker_loop(&pool.workers[0]);
+	pool_stop(&pool);
+
+	result = de->vals[dag->root];
+	dag_eval_free(de);
+	return result;
+}
@@ -0,0 +1,25 @@
+#ifndef EXPR_THREADS_H
+#define EXPR_THREADS_H
+
+#include "tree.h"
+
+/******************************************************************************
+ * Helper Functions
+ */
+
+/*
+ * Evaluates an expression tree on a pool of nthreads threads
+ * (the calling thread included), with work stealing.
+ * nthreads <= 0 uses one thread per online CPU.
+ */
+long long expr_threads_eval(struct tree_node *root, int nthreads);
+
+struct expr_dag;
+
+/*
+ * Same, for a hash-consed DAG: every node is evaluated once,
+ * by whichever worker completes its last child.
+ */
+long long expr_threads_eval_dag(const struct expr_dag *dag, int nthreads);
+
+#endif /* EXPR_THREADS_H */
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "expr.h"
+
+enum expr_op
+expr_op_of(struct tree_node *node)
+{
+	if (node->nr_children == 0)
+		return EXPR_VAL;
+
+	if (strcmp(node->name, "+") == 0)
+		return EXPR_ADD;
+	if (strcmp(node->name, "*") == 0)
+		return EXPR_MUL;
+	if (strcmp(node->name, "-") == 0)
+		return EXPR_SUB;
+
+	fprintf(stderr, "unknown operator: %s\n", node->name);
+	exit(1);
+}
+
+int
+expr_leaf_is_var(struct tree_node *node)
+{
+	return isalpha((unsigned char)node->name[0]) || node->name[0] == '_';
+}
+
+long long
+expr_leaf_value(struct tree_node *node)
+{
+	long long val;
+	char *endp;
+
+	if (expr_leaf_is_var(node)){
+		fprintf(stderr, "variable %s has no value, evaluate the tree in batch mode\n",
+			node->name);
+		exit(1);
+	}
+
+	errno = 0;
+	val = strtoll(node->name, &endp, 10);
+	if (endp == node->name || *endp != '\0' || errno != 0){
+		fprintf(stderr, "leaf is not an integer: %s\n", node->name);
+		exit(1);
+	}
+
+	return val;
+}
+
+int
+expr_op_is_commutative(enum expr_op op)
+{
+	return op == EXPR_ADD || op == EXPR_MUL;
+}
+
+long long
+expr_identity(enum expr_op op)
+{
+	return op == EXPR_MUL ? 1 : 0;
+}
+
+/*
+ * The arithmetic is done on unsigned values, so that
+ * large trees wrap around instead of hitting undefined behaviour.
+ */
+long long
+expr_apply(enum expr_op op, long long acc, long long val)
+{
+	unsigned long long a = acc, v = val;
+
+	switch (op){
+	case EXPR_ADD:
+		return a + v;
+	case EXPR_MUL:
+		return a * v;
+	case EXPR_SUB:
+		return a - v;
+	default:
+		fprintf(stderr, "%s: internal error: not an operator\n", __func__);
+		exit(1);
+	}
+}
+
+long long
+expr_fold(enum expr_op op, const long long *vals, unsigned n)
+{
+	long long acc;
+	unsigned i;
+
+	if (op == EXPR_SUB){
+		if (n == 1)
+			return expr_apply(op, 0, vals[0]);
+		acc = vals[0];
+		for (i = 1; i < n; i++)
+			acc = expr_apply(op, acc, vals[i]);
+		return acc;
+	}
+
+	acc = expr_identity(op);
+	for (i = 0; i < n; i++)
+		acc = expr_apply(op, acc, vals[i]);
+	return acc;
+}
+
+void
+expr_check(struct tree_node *root, int allow_vars)
+{
+	unsigned i;
+
+	if (expr_op_of(root) != EXPR_VAL){
+		for (i = 0; i < root->nr_children; i++)
+			expr_check(root->children + i, allow_vars);
+		return;
+	}
+
+	if (!allow_vars || !expr_leaf_is_var(root))
+		expr_leaf_value(root);
+}
+
+/*
+ * Recursive, in-process evaluation, used where a subtree is
+ * too small to be worth a process of its own.
+ */
+long long
+expr_eval(struct tree_node *root)
+{
+	enum expr_op op = expr_op_of(root);
+	long long acc;
+	unsigned i;
+
+	if (op == EXPR_VAL)
+		return expr_leaf_value(root);
+
+	acc = expr_eval(root->children);
+	if (op == EXPR_SUB && root->nr_children == 1)
+		return expr_apply(op, 0, acc);
+
+	for (i = 1; i < root->nr_children; i++)
+		acc = expr_apply(op, acc, expr_eval(root->children + i));
+
+	return acc;
+}
+
+unsigned long
+expr_count_nodes(struct tree_node *root, unsigned long limit)
+{
+	unsigned long n = 1;
+	unsigned i;
+
+	for (i = 0; i < root->nr_children && n <= limit; i++)
+		n += expr_count_nodes(root->children + i, limit - n);
+
+	return n;
+}
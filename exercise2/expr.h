@@ -0,0 +1,70 @@
+#ifndef EXPR_H
+#define EXPR_H
+
+#include "tree.h"
+
+/******************************************************************************
+ * Data structure definitions
+ */
+
+/*
+ * Operator of an expression tree node.
+ * Leaves hold integer literals or variable names, every other node
+ * applies its operator to all of its children (any number of them).
+ */
+enum expr_op {
+	EXPR_VAL,	/* leaf, integer literal or variable */
+	EXPR_ADD,	/* "+": c0 + c1 + ... + cn */
+	EXPR_MUL,	/* "*": c0 * c1 * ... * cn */
+	EXPR_SUB,	/* "-": c0 - c1 - ... - cn, or -c0 with one child */
+};
+
+
+/******************************************************************************
+ * Helper Functions
+ */
+
+/* returns the operator of a node, exits on an unknown operator */
+enum expr_op expr_op_of(struct tree_node *node);
+
+/*
+ * Returns non-zero if a leaf is a variable rather than a literal,
+ * i.e. its name starts with a letter or '_'.
+ */
+int expr_leaf_is_var(struct tree_node *node);
+
+/* returns the value of a leaf, exits if it is not an integer */
+long long expr_leaf_value(struct tree_node *node);
+
+/*
+ * Returns non-zero if the operands of op can be folded
+ * in any order, i.e. the operator is commutative and associative.
+ */
+int expr_op_is_commutative(enum expr_op op);
+
+/* returns the identity element of a commutative operator */
+long long expr_identity(enum expr_op op);
+
+/* returns acc op val; overflow wraps around */
+long long expr_apply(enum expr_op op, long long acc, long long val);
+
+/* folds n operand values, in index order */
+long long expr_fold(enum expr_op op, const long long *vals, unsigned n);
+
+/*
+ * Checks every operator and leaf of a tree, so that errors are
+ * reported before any evaluation starts. Variables are only accepted
+ * with allow_vars. Exits on the first error.
+ */
+void expr_check(struct tree_node *root, int allow_vars);
+
+/* evaluates a subtree in the calling process */
+long long expr_eval(struct tree_node *root);
+
+/*
+ * Returns the number of nodes in a subtree. Counting stops early
+ * once it goes past limit, so any result > limit means "too big".
+ */
+unsigned long expr_count_nodes(struct tree_node *root, unsigned long limit);
+
+#endif /* EXPR_H */
@@ -1,121 +1,941 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <signal.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
+#include <getopt.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
 #include <string.h>
+#include <libgen.h>
+#include <limits.h>
 
 #include "tree.h"
+#include "expr.h"
+#include "expr-dag.h"
+#include "expr-threads.h"
+#include "expr-pool.h"
+#include "expr-bytecode.h"
+#include "expr-batch.h"
+#include "expr-cols.h"
 #include "proc-common.h"
 
-void fork_procs(struct tree_node *root, int fd)
+/* -q: no per-process messages and no pstree, only the result and timings */
+static int quiet;
+
+#define trace(...) \
+        do { if (!quiet) printf(__VA_ARGS__); } while (0)
+
+static double now_ms(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void read_value(int fd, long long *val)
+{
+        ssize_t ret;
+
+        ret = read(fd, val, sizeof(*val));
+        if (ret < 0) {
+                perror("child: read from pipe");
+                exit(1);
+        }
+        if (ret != sizeof(*val)) {
+                fprintf(stderr, "PID = %ld: child exited without writing a value\n",
+                        (long)getpid());
+                exit(1);
+        }
+}
+
+static void write_value(int fd, long long val)
+{
+        if (write(fd, &val, sizeof(val)) != sizeof(val)) {
+                perror("parent: write to pipe");
+                exit(1);
+        }
+        proc_trace(PROC_EV_RESULT, val);
+}
+
+/*
+ * Read one value from each child pipe, in the order the children
+ * finish instead of index order, so that a slow subtree does not
+ * hold back the values of subtrees that are already done.
+ *
+ * Children evaluated in-process have pfd[i] < 0 and their value
+ * already in vals[i].
+ *
+ * For commutative operators every value is folded in as soon as it
+ * arrives, otherwise the values are kept and folded in index order
+ * once the last one is in.
+ */
+static long long collect_results(const char *name, enum expr_op op, unsigned n,
+        int pfd[], long long vals[])
+{
+        unsigned left = 0, i;
+        int fold_now = expr_op_is_commutative(op);
+        struct pollfd fds[n];
+        unsigned idx[n];
+        long long val, acc = 0;
+
+        if (fold_now)
+                acc = expr_identity(op);
+
+        for (i = 0; i < n; i++) {
+                if (pfd[i] < 0) {
+                        if (fold_now)
+                                acc = expr_apply(op, acc, vals[i]);
+                        continue;
+                }
+                fds[left].fd = pfd[i];
+                fds[left].events = POLLIN;
+                idx[left] = i;
+                left++;
+        }
+
+        while (left > 0) {
+                if (poll(fds, left, -1) < 0) {
+                        perror("poll");
+                        exit(1);
+                }
+                /*
+                 * Drop every pipe that is done by moving the last one in
+                 * its place; its revents are from this round too.
+                 */
+                for (i = 0; i < left; ) {
+                        if (fds[i].revents == 0) {
+                                i++;
+                                continue;
+                        }
+                        read_value(fds[i].fd, &val);
+                        trace("PID = %ld, name %s readed value %lld from child %u\n",
+                            (long)getpid(), name, val, idx[i]);
+                        if (fold_now)
+                                acc = expr_apply(op, acc, val);
+                        else
+                                vals[idx[i]] = val;
+                        close(fds[i].fd);
+
+                        left--;
+                        fds[i] = fds[left];
+                        idx[i] = idx[left];
+                }
+        }
+
+        if (!fold_now)
+                acc = expr_fold(op, vals, n);
+
+        return acc;
+}
+
+/*
+ * Granularity cutoff: a child subtree with at most cutoff_size nodes,
+ * or rooted at depth cutoff_depth or deeper, is evaluated inside its
+ * parent's process instead of getting a process tree of its own.
+ * Zero disables a cutoff.
+ */
+static unsigned long cutoff_size;
+static unsigned cutoff_depth;
+
+static int eval_in_process(struct tree_node *node, unsigned depth)
 {
-        printf("PID = %ld, name %s, starting...\n",(long)getpid(), root->name);
+        if (cutoff_depth != 0 && depth >= cutoff_depth)
+                return 1;
+        return cutoff_size != 0 &&
+                expr_count_nodes(node, cutoff_size) <= cutoff_size;
+}
+
+void fork_procs(struct tree_node *root, int fd, unsigned depth)
+{
+        long long result;
+
+        trace("PID = %ld, name %s, starting...\n",(long)getpid(), root->name);
         change_pname(root->name);
 
         if (root->nr_children != 0)
         {
-                printf("PID = %ld, name %s, waiting...\n",(long)getpid(), root->name);
-                int i=0;
+                trace("PID = %ld, name %s, waiting...\n",(long)getpid(), root->name);
+                int i=0, j, nr_forked = 0;
                 pid_t pidCHILD[root->nr_children];
-                int compute[2];
-                int pfd[2][2];
+                int pfd[root->nr_children];
+                long long vals[root->nr_children];
 
                 for(i = 0; i < root->nr_children; i++)
                 {
-                        if (pipe(pfd[i]) < 0)
+                        int p[2];
+
+                        // small subtrees are left for this process, see below
+                        if (eval_in_process(root->children+i, depth+1))
+                        {
+                                pidCHILD[i] = 0;
+                                pfd[i] = -1;
+                                continue;
+                        }
+                        if (pipe(p) < 0)
                         {
                                 perror("pipe");
                                 exit(1);
                         }
-                        pidCHILD[i] = fork();
-                        if (pidCHILD[i] < 0) 
+                        fflush(stdout);
+                        pidCHILD[i] = proc_trace_fork();
+                        if (pidCHILD[i] < 0)
                         {
                                 perror("fork_procs(): fork");
                                 exit(1);
                         } else if (pidCHILD[i] == 0)
                         {
-                                fork_procs(root->children+i, pfd[i][1]);
+                                // the child only needs the write end of its own pipe
+                                for (j = 0; j < i; j++)
+                                        if (pfd[j] >= 0)
+                                                close(pfd[j]);
+                                close(p[0]);
+                                fork_procs(root->children+i, p[1], depth+1);
                         }
+                        close(p[1]);
+                        pfd[i] = p[0];
+                        nr_forked++;
                 }
-                wait_for_ready_children(2);
-                if (read(pfd[0][0], &(compute[0]), sizeof(compute[0])) != sizeof(compute[0])) {
-                        perror("child: read from pipe");
-                        exit(1);
-                }
-                printf("PID = %ld, name %s readed value %d from child\n",
-                    (long)getpid(), root->name, compute[0]);
-                if (read(pfd[1][0], &(compute[1]), sizeof(compute[1])) != sizeof(compute[1])) {
-                        perror("child: read from pipe");
-                        exit(1);
-                }
-                printf("PID = %ld, name %s readed value %d from child\n",
-                    (long)getpid(), root->name, compute[1]);
-
 
-                int result = 0;
-                // function strcmp(str1, str2) compares str1, str2
-                // and returns zero if they are identical
-                if(strcmp(root->name, "*") == 0) {
-                    printf("PID = %ld, computing %d %s %d\n",
-                            (long)getpid(), compute[0], root->name, compute[1]);
-                    result = compute[0] * compute[1];
-                }
-                else {
-                    printf("PID = %ld, computing %d %s %d\n",
-                            (long)getpid(), compute[0], root->name, compute[1]);
-                    result = compute[0] + compute[1];
+                // evaluate them while the forked children are running
+                for(i = 0; i < root->nr_children; i++)
+                {
+                        if (pfd[i] >= 0)
+                                continue;
+                        vals[i] = expr_eval(root->children+i);
+                        trace("PID = %ld, name %s evaluated child %d (%s) in-process = %lld\n",
+                            (long)getpid(), root->name, i, root->children[i].name, vals[i]);
                 }
 
-                printf("PID = %ld, writing result = %d to parent\n",
+                result = collect_results(root->name, expr_op_of(root),
+                        root->nr_children, pfd, vals);
+                // every child has written its value, so it is stopped or about to be
+                wait_for_ready_children(nr_forked);
+
+                trace("PID = %ld, computed %s over %u values = %lld\n",
+                    (long)getpid(), root->name, root->nr_children, result);
+                trace("PID = %ld, writing result = %lld to parent\n",
                             (long)getpid(), result);
                 //write to pipe
-                if (write(fd, &result, sizeof(result)) != sizeof(result))
-                {
-                        perror("parent: write to pipe");
-                        exit(1);
-                }
+                write_value(fd, result);
                 // raise a signal so that parent knows that you have computed the result
+                proc_trace(PROC_EV_STOP, 0);
                 raise(SIGSTOP);
+                proc_trace(PROC_EV_CONT, 0);
 
                 // code executed after SIGCONT is raised for this process
-                printf("PID = %ld, name %s is awake\n",(long)getpid(), root->name);
+                trace("PID = %ld, name %s is awake\n",(long)getpid(), root->name);
 
                 // wake up a child, wait for it to terminate
                 // do the same for all of your children
                 for(i = 0; i < root->nr_children; i++) {
                         // wake up child with pid: pidCHILD[i]
-                        kill(pidCHILD[i], SIGCONT);
+                        if (pidCHILD[i] != 0)
+                                kill(pidCHILD[i], SIGCONT);
                 }
                 pid_t wpid;
                 int status = 0;
-                while( (wpid = wait(&status)) > 0);
+                while( (wpid = wait(&status)) > 0)
+                        proc_trace(PROC_EV_REAP, wpid);
        }
         else
         {
-                int charToInt;
-                // convert char to int using sscanf
-                sscanf((root->name), "%d", &charToInt);
-                printf("PID = %ld, name %s writing value %d to parent\n",
-                    (long)getpid(), root->name, charToInt);
-                if (write(fd, &charToInt, sizeof(charToInt)) != sizeof(charToInt))
-                {
-                        perror("parent: write to pipe");
-                        exit(1);
-                }
+                result = expr_leaf_value(root);
+                trace("PID = %ld, name %s writing value %lld to parent\n",
+                    (long)getpid(), root->name, result);
+                write_value(fd, result);
                 // raise a signal so that parent knows that you have computed the result
+                proc_trace(PROC_EV_STOP, 0);
                 raise(SIGSTOP);
+                proc_trace(PROC_EV_CONT, 0);
 
                 // code executed after SIGCONT is raised for this process
-                printf("PID = %ld, name %s is awake\n",(long)getpid(), root->name);
+                trace("PID = %ld, name %s is awake\n",(long)getpid(), root->name);
         }
 
-        printf("PID = %ld, name %s, exiting...\n",(long)getpid(), root->name);
+        trace("PID = %ld, name %s, exiting...\n",(long)getpid(), root->name);
         exit(0);
 }
 
+/*
+ * -c: the process tree of a hash-consed DAG. Every unique node is
+ * evaluated by one process only, the first one to claim it in the
+ * shared memo; the others that need its value wait for it in the memo
+ * instead of reading it from a pipe.
+ */
+enum memo_state {
+        MEMO_FREE,
+        MEMO_CLAIMED,
+        MEMO_DONE
+};
+
+struct dag_memo {
+        int             state;
+        long long       val;
+};
+
+static struct dag_memo *memo;
+
+static int memo_claim(unsigned id)
+{
+        int free_state = MEMO_FREE;
+
+        return __atomic_compare_exchange_n(&memo[id].state, &free_state, MEMO_CLAIMED,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static void memo_publish(unsigned id, long long val)
+{
+        memo[id].val = val;
+        __atomic_store_n(&memo[id].state, MEMO_DONE, __ATOMIC_RELEASE);
+}
+
+/*
+ * The claimer of a node only waits for nodes below it,
+ * so every wait ends once the leaves are reached.
+ */
+static long long memo_wait(unsigned id)
+{
+        while (__atomic_load_n(&memo[id].state, __ATOMIC_ACQUIRE) != MEMO_DONE)
+                sched_yield();
+        return memo[id].val;
+}
+
+/* in-process evaluation of a node, through the memo */
+static long long dag_value(const struct expr_dag *dag, unsigned id)
+{
+        const struct dag_node *node = &dag->nodes[id];
+        long long result;
+        unsigned i;
+
+        if (node->op == EXPR_VAL)
+                return node->val;
+        if (!memo_claim(id))
+                return memo_wait(id);
+
+        long long vals[node->nr_children];
+        for (i = 0; i < node->nr_children; i++)
+                vals[i] = dag_value(dag, dag->edges[node->first + i]);
+        result = expr_fold(node->op, vals, node->nr_children);
+        memo_publish(id, result);
+        return result;
+}
+
+static int dag_eval_in_process(const struct dag_node *node, unsigned depth)
+{
+        if (cutoff_depth != 0 && depth >= cutoff_depth)
+                return 1;
+        return cutoff_size != 0 && node->size <= cutoff_size;
+}
+
+/* the node has been claimed by the parent of this process */
+__attribute__((noreturn))
+void fork_dag_procs(const struct expr_dag *dag, unsigned id, int fd, unsigned depth)
+{
+        const struct dag_node *node = &dag->nodes[id];
+        unsigned n = node->nr_children, i, child;
+        int j, nr_forked = 0;
+        pid_t pid, pidCHILD[n ? n : 1];
+        int pfd[n ? n : 1];
+        long long vals[n ? n : 1], result;
+
+        trace("PID = %ld, name %s (node %u), starting...\n", (long)getpid(), node->name, id);
+        change_pname(node->name);
+
+        for (i = 0; i < n; i++) {
+                int p[2];
+
+                child = dag->edges[node->first + i];
+                pidCHILD[i] = 0;
+                pfd[i] = -1;
+                // leaves, small subtrees and nodes someone else claimed are left for later
+                if (dag->nodes[child].op == EXPR_VAL ||
+                    dag_eval_in_process(&dag->nodes[child], depth + 1) ||
+                    !memo_claim(child))
+                        continue;
+                if (pipe(p) < 0) {
+                        perror("pipe");
+                        exit(1);
+                }
+                fflush(stdout);
+                pidCHILD[i] = proc_trace_fork();
+                if (pidCHILD[i] < 0) {
+                        perror("fork_dag_procs(): fork");
+                        exit(1);
+                } else if (pidCHILD[i] == 0) {
+                        for (j = 0; j < (int)i; j++)
+                                if (pfd[j] >= 0)
+                                        close(pfd[j]);
+                        close(p[0]);
+                        fork_dag_procs(dag, child, p[1], depth + 1);
+                }
+                close(p[1]);
+                pfd[i] = p[0];
+                nr_forked++;
+        }
+
+        // evaluate, or wait for, the rest while the forked children are running
+        for (i = 0; i < n; i++) {
+                if (pfd[i] >= 0)
+                        continue;
+                vals[i] = dag_value(dag, dag->edges[node->first + i]);
+                trace("PID = %ld, name %s got child %u (node %u) in-process = %lld\n",
+                    (long)getpid(), node->name, i, dag->edges[node->first + i], vals[i]);
+        }
+
+        if (n != 0) {
+                result = collect_results(node->name, node->op, n, pfd, vals);
+                wait_for_ready_children(nr_forked);
+        } else
+                result = node->val;
+
+        trace("PID = %ld, writing result = %lld to parent\n", (long)getpid(), result);
+        // publish the value before anybody can see it on the pipe
+        if (n != 0)
+                memo_publish(id, result);
+        write_value(fd, result);
+        proc_trace(PROC_EV_STOP, 0);
+        raise(SIGSTOP);
+        proc_trace(PROC_EV_CONT, 0);
+
+        trace("PID = %ld, name %s is awake\n", (long)getpid(), node->name);
+        for (i = 0; i < n; i++)
+                if (pidCHILD[i] != 0)
+                        kill(pidCHILD[i], SIGCONT);
+        while ((pid = wait(NULL)) > 0)
+                proc_trace(PROC_EV_REAP, pid);
+
+        trace("PID = %ld, name %s, exiting...\n", (long)getpid(), node->name);
+        exit(0);
+}
+
+/*
+ * Evaluation engines: "procs" is the process tree above, the
+ * others evaluate the tree inside this process.
+ */
+enum engine {
+        ENGINE_PROCS,
+        ENGINE_THREADS,
+        ENGINE_RECURSIVE,
+        ENGINE_BYTECODE,
+        ENGINE_VECTOR,
+        ENGINE_POOL,
+        NR_ENGINES
+};
+
+static const char *engine_names[NR_ENGINES] = {
+        [ENGINE_PROCS] = "procs",
+        [ENGINE_THREADS] = "threads",
+        [ENGINE_RECURSIVE] = "recursive",
+        [ENGINE_BYTECODE] = "bytecode",
+        [ENGINE_VECTOR] = "vector",
+        [ENGINE_POOL] = "pool",
+};
+
+/* -t: number of threads for the threads engine, 0 for one per CPU */
+static int nr_threads;
+
+/* -p: worker processes of the pool engine, 0 for one per CPU */
+static int nr_procs;
+
+/* -r: evaluations to average the evaluation time over */
+static int nr_repeat = 1;
+
+static void usage(char *argv0)
+{
+        fprintf(stderr, "Usage: %s [-q] [-s SIZE] [-d DEPTH] [-a] [-c] [-w] [--engine=ENGINE] [-t NTHREADS] [-p NPROCS] [-r REPEAT]\n"
+                        "          [-b COLUMN_FILE [-o OUT_FILE]] [-T TRACE_FILE] <tree_file>\n\n"
+                        "    -q: quiet, print only the result and the timings\n"
+                        "    -s SIZE: evaluate subtrees of at most SIZE nodes in-process\n"
+                        "    -d DEPTH: evaluate subtrees at depth DEPTH or deeper in-process\n"
+                        "    -a: pick SIZE from the measured process and evaluation cost\n"
+                        "    -c: merge identical subtrees, so that each one is evaluated once\n"
+                        "    -w: watch the tree file, re-evaluate only what changed on every save\n"
+                        "    --engine=ENGINE: procs (default), threads, recursive, bytecode, pool\n"
+                        "                     or vector (batch mode only)\n"
+                        "    -t NTHREADS: threads of the threads engine (default: one per CPU)\n"
+                        "    -p NPROCS: worker processes of the pool engine (default: one per CPU)\n"
+                        "    -r REPEAT: average the evaluation time over REPEAT runs\n"
+                        "               (all engines but procs)\n"
+                        "    -b COLUMN_FILE: batch mode, evaluate the tree once for every row\n"
+                        "                    of variable values, with the vector engine (default)\n"
+                        "                    or row by row with the bytecode engine\n"
+                        "    -o OUT_FILE: write the batch results as a column file\n"
+                        "    -T TRACE_FILE: trace the life of every process, in Chrome trace format\n",
+                        argv0);
+        exit(1);
+}
+
+static enum engine engine_of(char *name)
+{
+        int i;
+
+        for (i = 0; i < NR_ENGINES; i++)
+                if (strcmp(name, engine_names[i]) == 0)
+                        return i;
+
+        fprintf(stderr, "`%s' is not a valid engine\n", name);
+        exit(1);
+}
+
+/*
+ * Function for safe atoi from pthread-test.c
+ */
+static int safe_atoi(char *s, int *val)
+{
+        long l;
+        char *endp;
+
+        l = strtol(s, &endp, 10);
+        if (s != endp && *endp == '\0') {
+                *val = l;
+                return 0;
+        } else
+                return -1;
+}
+
+#define TUNE_FORKS      64
+#define TUNE_MIN_MS     5.0
+
+/*
+ * Cost of one process in the tree: pipe, fork, the child writing
+ * a value and exiting, the parent reading it and reaping the child.
+ */
+static double measure_fork_cost_us(void)
+{
+        double start;
+        long long val;
+        int i, p[2];
+        pid_t pid;
+
+        start = now_ms();
+        for (i = 0; i < TUNE_FORKS; i++) {
+                if (pipe(p) < 0) {
+                        perror("pipe");
+                        exit(1);
+                }
+                fflush(stdout);
+                pid = fork();
+                if (pid < 0) {
+                        perror("measure_fork_cost_us: fork");
+                        exit(1);
+                }
+                if (pid == 0) {
+                        close(p[0]);
+                        write_value(p[1], i);
+                        _exit(0);
+                }
+                close(p[1]);
+                read_value(p[0], &val);
+                close(p[0]);
+                waitpid(pid, NULL, 0);
+        }
+
+        return (now_ms() - start) * 1e3 / TUNE_FORKS;
+}
+
+/* Average in-process evaluation cost of one node of this tree. */
+static double measure_node_cost_us(struct tree_node *root)
+{
+        volatile long long sink;
+        unsigned long nodes, reps = 0;
+        double start, elapsed;
+
+        nodes = expr_count_nodes(root, -1UL);
+        start = now_ms();
+        do {
+                sink = expr_eval(root);
+                reps++;
+                elapsed = now_ms() - start;
+        } while (elapsed < TUNE_MIN_MS);
+        (void)sink;
+
+        return elapsed * 1e3 / (reps * nodes);
+}
+
+/*
+ * A subtree is worth a process of its own only when evaluating it
+ * takes longer than creating that process, so the size cutoff is
+ * the number of nodes that can be evaluated in the time of one fork.
+ */
+static unsigned long autotune_cutoff(struct tree_node *root)
+{
+        double fork_us, node_us;
+        unsigned long size;
+
+        fork_us = measure_fork_cost_us();
+        node_us = measure_node_cost_us(root);
+        size = fork_us / node_us;
+        if (size < 1)
+                size = 1;
+
+        printf("autotune: process %.1f us, node %.4f us, cutoff size = %lu\n",
+                fork_us, node_us, size);
+        return size;
+}
+
+/*
+ * Engines that do not build a process tree:
+ * evaluate, then report the result and the evaluation time.
+ */
+static void run_engine(enum engine engine, struct tree_node *root, struct expr_dag *dag)
+{
+        struct expr_bc *bc = NULL;
+        struct expr_pool *pool = NULL;
+        struct pool_stats stats;
+        long long result = 0, *stack = NULL;
+        double start;
+        int i;
+
+        if (engine == ENGINE_POOL) {
+                if (dag != NULL) {
+                        fprintf(stderr, "the pool engine evaluates trees only, not -c\n");
+                        exit(1);
+                }
+                start = now_ms();
+                pool = expr_pool_create(root, nr_procs, cutoff_size);
+                printf("pool: %d worker processes, started in %.3f ms\n",
+                        expr_pool_size(pool), now_ms() - start);
+        }
+
+        if (engine == ENGINE_BYTECODE) {
+                start = now_ms();
+                bc = dag != NULL ? expr_bc_compile_dag(dag) : expr_bc_compile(root);
+                stack = malloc((bc->max_stack + bc->nr_slots) * sizeof(*stack));
+                if (stack == NULL) {
+                        fprintf(stderr, "stack allocation failed\n");
+                        exit(1);
+                }
+                printf("compile time = %.3f ms, %lu instructions, stack depth %lu, %lu slots\n",
+                        now_ms() - start, bc->len, bc->max_stack, bc->nr_slots);
+        }
+
+        start = now_ms();
+        for (i = 0; i < nr_repeat; i++) {
+                switch (engine) {
+                case ENGINE_THREADS:
+                        if (dag != NULL)
+                                result = expr_threads_eval_dag(dag, nr_threads);
+                        else
+                                result = expr_threads_eval(root, nr_threads);
+                        break;
+                case ENGINE_RECURSIVE:
+                        if (dag != NULL)
+                                result = expr_dag_eval(dag);
+                        else
+                                result = expr_eval(root);
+                        break;
+                case ENGINE_BYTECODE:
+                        result = expr_bc_run(bc, stack, NULL);
+                        break;
+                case ENGINE_POOL:
+                        result = expr_pool_eval(pool, &stats);
+                        break;
+                default:
+                        fprintf(stderr, "%s: internal error: engine %d\n", __func__, engine);
+                        exit(1);
+                }
+        }
+        printf("engine %s: result = %lld\n", engine_names[engine], result);
+        printf("evaluation time = %.3f ms\n", (now_ms() - start) / nr_repeat);
+
+        if (bc != NULL) {
+                free(stack);
+                expr_bc_free(bc);
+        }
+        if (pool != NULL) {
+                printf("dispatch latency (last run): %lu tasks, mean %.1f us, "
+                        "p50 %.1f us, p99 %.1f us, max %.1f us\n",
+                        stats.nr_tasks, stats.mean_us, stats.p50_us, stats.p99_us, stats.max_us);
+                expr_pool_destroy(pool);
+        }
+}
+
+/*
+ * Batch mode: evaluate the tree for every row of variable values in a
+ * column file, either a block of rows at a time (vector) or a row at a
+ * time (bytecode). Reports a checksum of the results and the throughput.
+ */
+static void run_batch(enum engine engine, struct tree_node *root, struct expr_dag *dag,
+        const char *col_filename, const char *out_filename)
+{
+        static char result_name[1][NODE_NAME_SIZE] = { "result" };
+        struct expr_bc *bc;
+        struct col_file *cf;
+        long long **vars, *out, *stack, *row;
+        unsigned long long checksum = 0;
+        unsigned long r;
+        unsigned v;
+        double start, elapsed;
+        int i;
+
+        if (engine != ENGINE_VECTOR && engine != ENGINE_BYTECODE) {
+                fprintf(stderr, "batch mode needs the vector or the bytecode engine\n");
+                exit(1);
+        }
+
+        bc = dag != NULL ? expr_bc_compile_dag(dag) : expr_bc_compile(root);
+        cf = cols_open(col_filename);
+
+        vars = malloc((bc->nr_vars + 1) * sizeof(*vars));
+        row = malloc((bc->nr_vars + 1) * sizeof(*row));
+        stack = malloc((bc->max_stack + bc->nr_slots) * sizeof(*stack));
+        out = malloc((cf->nr_rows + 1) * sizeof(*out));
+        if (vars == NULL || row == NULL || stack == NULL || out == NULL) {
+                fprintf(stderr, "batch allocation failed\n");
+                exit(1);
+        }
+        for (v = 0; v < bc->nr_vars; v++) {
+                vars[v] = cols_find(cf, bc->vars[v]);
+                if (vars[v] == NULL) {
+                        fprintf(stderr, "%s: no column for variable %s\n",
+                                col_filename, bc->vars[v]);
+                        exit(1);
+                }
+        }
+
+        start = now_ms();
+        for (i = 0; i < nr_repeat; i++) {
+                if (engine == ENGINE_VECTOR) {
+                        expr_batch_eval(bc, vars, cf->nr_rows, out);
+                        continue;
+                }
+                for (r = 0; r < cf->nr_rows; r++) {
+                        for (v = 0; v < bc->nr_vars; v++)
+                                row[v] = vars[v][r];
+                        out[r] = expr_bc_run(bc, stack, row);
+                }
+        }
+        elapsed = (now_ms() - start) / nr_repeat;
+
+        for (r = 0; r < cf->nr_rows; r++)
+                checksum += out[r];
+        printf("batch %s: %lu rows, %u variables, checksum = %lld\n",
+                engine_names[engine], cf->nr_rows, bc->nr_vars, (long long)checksum);
+        printf("evaluation time = %.3f ms, %.1f Mrows/s\n",
+                elapsed, cf->nr_rows / elapsed / 1e3);
+
+        if (out_filename != NULL)
+                cols_write(out_filename, 1, result_name, &out, cf->nr_rows);
+
+        free(out);
+        free(stack);
+        free(row);
+        free(vars);
+        cols_close(cf);
+        expr_bc_free(bc);
+}
+
+/* -c: build the DAG and report how much of the tree was duplicated */
+static struct expr_dag *build_dag(struct tree_node *root)
+{
+        struct expr_dag *dag;
+        double start;
+
+        start = now_ms();
+        dag = expr_dag_build(root);
+        printf("dag: %lu tree nodes -> %u unique, %lu deduplicated (%.1f%%), %.3f ms\n",
+                dag->tree_nodes, dag->nr_nodes, dag->tree_nodes - dag->nr_nodes,
+                100.0 * (dag->tree_nodes - dag->nr_nodes) / dag->tree_nodes,
+                now_ms() - start);
+        printf("dag: %lu KiB of tree nodes -> %lu KiB of dag nodes and edges\n",
+                dag->tree_nodes * sizeof(struct tree_node) / 1024,
+                (dag->nr_nodes * sizeof(struct dag_node) +
+                 dag->nr_edges * sizeof(*dag->edges)) / 1024);
+        return dag;
+}
+
+/*
+ * -w: copies the tree file into a memfd, so that it is validated and
+ * parsed as one snapshot, even if the editor saves it again in between.
+ * The snapshot is read through its /proc/self/fd path, stored in path.
+ * Returns the memfd, or -1 if the file could not be read.
+ */
+static int snapshot_tree_file(const char *filename, char *path, size_t size)
+{
+        int fd, memfd;
+        ssize_t ret;
+
+        fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                perror(filename);
+                return -1;
+        }
+        memfd = memfd_create("tree", MFD_CLOEXEC);
+        if (memfd < 0) {
+                perror("memfd_create");
+                exit(1);
+        }
+        while ((ret = sendfile(memfd, fd, NULL, 1 << 30)) > 0)
+                ;
+        close(fd);
+        if (ret < 0) {
+                perror(filename);
+                close(memfd);
+                return -1;
+        }
+        snprintf(path, size, "/proc/self/fd/%d", memfd);
+        return memfd;
+}
+
+/*
+ * -w: the snapshot is parsed in a child process first, as the parser
+ * exits on any error, and a half-written file must not end the watch.
+ */
+static int tree_file_is_valid(const char *filename, const char *snapshot)
+{
+        struct tree_node *root;
+        int status;
+        pid_t pid;
+
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0) {
+                perror("tree_file_is_valid: fork");
+                exit(1);
+        }
+        if (pid == 0) {
+                root = get_tree_from_file(snapshot);
+                if (root == NULL) {
+                        fprintf(stderr, "%s: empty tree\n", filename);
+                        exit(1);
+                }
+                expr_check(root, 0);
+                exit(0);
+        }
+        if (waitpid(pid, &status, 0) < 0) {
+                perror("waitpid");
+                exit(1);
+        }
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+ * Parses the tree file and evaluates it, reusing the value of every
+ * subexpression that was in the previous version of the tree.
+ */
+static void reevaluate(const char *filename, struct expr_dag **dag, long long **vals)
+{
+        struct tree_node *root;
+        struct expr_dag *new_dag;
+        long long *new_vals;
+        unsigned nr_evaluated;
+        double start, parsed;
+
+        start = now_ms();
+        root = get_tree_from_file(filename);
+        new_dag = expr_dag_build(root);
+        free_tree(root);
+        new_vals = malloc(new_dag->nr_nodes * sizeof(*new_vals));
+        if (new_vals == NULL) {
+                fprintf(stderr, "watch: allocation failed\n");
+                exit(1);
+        }
+        parsed = now_ms();
+        nr_evaluated = expr_dag_eval_incremental(new_dag, new_vals, *dag, *vals);
+
+        printf("watch: result = %lld\n", new_vals[new_dag->root]);
+        printf("watch: %lu tree nodes, %u unique: %u reused, %u evaluated; "
+                "parse %.3f ms, evaluation %.3f ms\n",
+                new_dag->tree_nodes, new_dag->nr_nodes, new_dag->nr_nodes - nr_evaluated,
+                nr_evaluated, parsed - start, now_ms() - parsed);
+        fflush(stdout);
+
+        if (*dag != NULL)
+                expr_dag_free(*dag);
+        free(*vals);
+        *dag = new_dag;
+        *vals = new_vals;
+}
+
+/*
+ * Watches the directory rather than the file, so that editors
+ * that save by renaming a new file over the old one are seen too.
+ */
+static void watch_tree(const char *filename)
+{
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        char dir_copy[PATH_MAX], base_copy[PATH_MAX], *dir, *base;
+        const struct inotify_event *ev;
+        struct expr_dag *dag = NULL;
+        long long *vals = NULL;
+        ssize_t len;
+        char snapshot[PATH_MAX], *p;
+        int fd, memfd, changed;
+
+        snprintf(dir_copy, sizeof(dir_copy), "%s", filename);
+        snprintf(base_copy, sizeof(base_copy), "%s", filename);
+        dir = dirname(dir_copy);
+        base = basename(base_copy);
+
+        fd = inotify_init1(IN_CLOEXEC);
+        if (fd < 0) {
+                perror("inotify_init1");
+                exit(1);
+        }
+        if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+                perror(dir);
+                exit(1);
+        }
+
+        reevaluate(filename, &dag, &vals);
+        printf("watch: waiting for changes to %s\n", filename);
+        fflush(stdout);
+
+        for (;;) {
+                len = read(fd, buf, sizeof(buf));
+                if (len < 0) {
+                        perror("watch: read");
+                        exit(1);
+                }
+                changed = 0;
+                for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+                        ev = (const struct inotify_event *)p;
+                        if ((ev->mask & IN_Q_OVERFLOW) ||
+                            (ev->len != 0 && strcmp(ev->name, base) == 0))
+                                changed = 1;
+                }
+                if (!changed)
+                        continue;
+
+                memfd = snapshot_tree_file(filename, snapshot, sizeof(snapshot));
+                if (memfd < 0 || !tree_file_is_valid(filename, snapshot)) {
+                        printf("watch: %s is not a valid tree, keeping the previous one\n",
+                                filename);
+                        fflush(stdout);
+                        if (memfd >= 0)
+                                close(memfd);
+                        continue;
+                }
+                reevaluate(snapshot, &dag, &vals);
+                close(memfd);
+        }
+}
+
+/*
+ * A node with many children keeps one pipe per child open,
+ * so allow as many descriptors as the hard limit permits.
+ */
+static void raise_fd_limit(void)
+{
+        struct rlimit rl;
+
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+                rl.rlim_cur = rl.rlim_max;
+                setrlimit(RLIMIT_NOFILE, &rl);
+        }
+}
+
 /*
  * The initial process forks the root of the process tree,
  * waits for the process tree to be completely created,
@@ -123,18 +943,129 @@ void fork_procs(struct tree_node *root, int fd)
  *
  * use wait_for_ready_children() to wait until
  * the first process raises SIGSTOP.
- * Then SIGCONT root, and the rest of the tree 
+ * Then SIGCONT root, and the rest of the tree
  * will wake up from fork_procs()
+ *
+ * The time from forking the root until its result is read
+ * is the critical path latency of the evaluation.
  */
 
 int main(int argc, char *argv[])
 {
         pid_t pid;
-        int status;
+        int status, opt, val, autotune = 0, use_dag = 0, watch = 0;
+        enum engine engine = ENGINE_PROCS;
+        char *col_filename = NULL, *out_filename = NULL, *trace_filename = NULL;
         struct tree_node *root;
+        struct expr_dag *dag = NULL;
+        double start, end;
+        static struct option long_options[] = {
+                { "engine", required_argument, NULL, 'e' },
+                { 0, 0, 0, 0 }
+        };
+
+        while ((opt = getopt_long(argc, argv, "qs:d:acwr:t:p:b:o:T:", long_options, NULL)) != -1) {
+                switch (opt) {
+                case 'b':
+                        col_filename = optarg;
+                        break;
+                case 'o':
+                        out_filename = optarg;
+                        break;
+                case 'T':
+                        trace_filename = optarg;
+                        break;
+                case 'e':
+                        engine = engine_of(optarg);
+                        break;
+                case 't':
+                        if (safe_atoi(optarg, &nr_threads) < 0 || nr_threads <= 0) {
+                                fprintf(stderr, "`%s' is not valid for `NTHREADS'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'p':
+                        if (safe_atoi(optarg, &nr_procs) < 0 || nr_procs <= 0) {
+                                fprintf(stderr, "`%s' is not valid for `NPROCS'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'r':
+                        if (safe_atoi(optarg, &nr_repeat) < 0 || nr_repeat <= 0) {
+                                fprintf(stderr, "`%s' is not valid for `REPEAT'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'q':
+                        quiet = 1;
+                        break;
+                case 's':
+                        if (safe_atoi(optarg, &val) < 0 || val < 0) {
+                                fprintf(stderr, "`%s' is not valid for `SIZE'\n", optarg);
+                                exit(1);
+                        }
+                        cutoff_size = val;
+                        break;
+                case 'd':
+                        if (safe_atoi(optarg, &val) < 0 || val < 0) {
+                                fprintf(stderr, "`%s' is not valid for `DEPTH'\n", optarg);
+                                exit(1);
+                        }
+                        cutoff_depth = val;
+                        break;
+                case 'a':
+                        autotune = 1;
+                        break;
+                case 'c':
+                        use_dag = 1;
+                        break;
+                case 'w':
+                        watch = 1;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (optind != argc - 1)
+                usage(argv[0]);
+
+        raise_fd_limit();
+        if (trace_filename != NULL)
+                proc_trace_init(trace_filename, 0);
 
         /* Read tree into memory */
-        root = get_tree_from_file(argv[1]);
+        root = get_tree_from_file(argv[optind]);
+        if (root == NULL) {
+                fprintf(stderr, "%s: empty tree\n", argv[optind]);
+                exit(1);
+        }
+        expr_check(root, col_filename != NULL);
+        if (watch) {
+                free_tree(root);
+                watch_tree(argv[optind]);
+        }
+        if (use_dag)
+                dag = build_dag(root);
+        if (col_filename != NULL) {
+                run_batch(engine == ENGINE_PROCS ? ENGINE_VECTOR : engine,
+                        root, dag, col_filename, out_filename);
+                return 0;
+        }
+        if (engine == ENGINE_VECTOR) {
+                fprintf(stderr, "the vector engine needs batch mode (-b)\n");
+                exit(1);
+        }
+        if (engine != ENGINE_PROCS) {
+                run_engine(engine, root, dag);
+                return 0;
+        }
+        if (autotune)
+                cutoff_size = autotune_cutoff(root);
+        if (dag != NULL) {
+                memo = create_shared_memory_area(dag->nr_nodes * sizeof(*memo));
+                memo_claim(dag->root);
+        }
+
         /* Fork root of process tree */
         int pfd[2];
         if (pipe(pfd) < 0)
@@ -143,42 +1074,51 @@ int main(int argc, char *argv[])
                 exit(1);
         }
 
-        pid = fork();
+        fflush(stdout);
+        start = now_ms();
+        pid = proc_trace_fork();
         if (pid < 0) {
                 perror("main: fork");
                 exit(1);
         }
         if (pid == 0) {
-                fork_procs(root, pfd[1]);
+                close(pfd[0]);
+                if (dag != NULL)
+                        fork_dag_procs(dag, dag->root, pfd[1], 0);
+                fork_procs(root, pfd[1], 0);
 
                 // child should never reach this point(it should have exited already)
                 exit(1);
         }
-        // wait until it raises SIGSTOP (the result is computed)
+        close(pfd[1]);
+
+        // read what root computed, it raises SIGSTOP right after
+        long long result;
+        read_value(pfd[0], &result);
+        end = now_ms();
         wait_for_ready_children(1);
 
-        // read what root computed
-        int result;
-        if (read(pfd[0], &result, sizeof(result)) != sizeof(result)) {
-                perror("child: read from pipe");
-                exit(1);
-        }
-        printf("PID = %ld, reading result from root of tree = %d\n",
+        printf("PID = %ld, reading result from root of tree = %lld\n",
                 (long)getpid(), result);
+        printf("critical path latency = %.3f ms\n", end - start);
 
-        /* Print tree to see its form */
-        print_tree(root);
+        if (!quiet) {
+                /* Print tree to see its form */
+                print_tree(root);
 
-        /* Print the process tree root at pid */
-        show_pstree(getpid());
+                /* Print the process tree root at pid */
+                show_pstree(getpid());
+        }
 
         // wake up root of tree
-        printf("Waking up PID: %d\n", pid);
+        trace("Waking up PID: %d\n", pid);
         kill(pid, SIGCONT);
 
         /* Wait for the root of the process tree to terminate */
         wait(&status);
-        explain_wait_status(pid, status);
+        proc_trace(PROC_EV_REAP, pid);
+        if (!quiet)
+                explain_wait_status(pid, status);
 
         return 0;
 }
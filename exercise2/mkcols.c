@@ -0,0 +1,74 @@
+/*
+ * mkcols.c
+ *
+ * Creates a columnar file of random variable bindings,
+ * for batch evaluation with main1.4 -b.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "tree.h"
+#include "expr-cols.h"
+
+static void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-s SEED] [-m MAX] <out_file> <rows> <name>...\n\n"
+			"    Writes one column of <rows> random values in [-MAX, MAX]\n"
+			"    (default 100) for every <name>.\n",
+			argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	char (*names)[NODE_NAME_SIZE];
+	unsigned long rows, r;
+	long long **cols;
+	unsigned seed = 1, i, nr_cols;
+	long max = 100;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:m:")) != -1) {
+		switch (opt) {
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			max = strtol(optarg, NULL, 10);
+			if (max < 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind < 3)
+		usage(argv[0]);
+
+	rows = strtoul(argv[optind + 1], NULL, 10);
+	nr_cols = argc - optind - 2;
+	names = calloc(nr_cols, sizeof(*names));
+	cols = malloc(nr_cols * sizeof(*cols));
+	if (names == NULL || cols == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		exit(1);
+	}
+
+	srand(seed);
+	for (i = 0; i < nr_cols; i++) {
+		snprintf(names[i], NODE_NAME_SIZE, "%s", argv[optind + 2 + i]);
+		cols[i] = malloc(rows * sizeof(long long));
+		if (cols[i] == NULL) {
+			fprintf(stderr, "allocation failed\n");
+			exit(1);
+		}
+		for (r = 0; r < rows; r++)
+			cols[i][r] = rand() % (2 * max + 1) - max;
+	}
+
+	cols_write(argv[optind], nr_cols, names, cols, rows);
+
+	return 0;
+}
@@ -1,5 +1,12 @@
 /*
  * pipe-example.c
+ *
+ * Without arguments: a parent passes a value to its child through a pipe.
+ * With -b: benchmarks pipes, socketpairs and the shared-memory ring of
+ * spsc-ring.c, for message latency (ping-pong) and throughput (one-way
+ * stream), over message sizes from 8 B up to MAX_SIZE.
+ * With -z: benchmarks bulk transfers through a pipe into a file, with
+ * write()/read() against vmsplice()/splice().
  */
 
 #include <unistd.h>
@@ -7,10 +14,15 @@
 #include <stdio.h>
 #include <signal.h>
 #include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
 
 #include <sys/wait.h>
+#include <sys/socket.h>
 
 #include "proc-common.h"
+#include "spsc-ring.h"
 
 void child(int fd)
 {
@@ -27,7 +39,373 @@ void child(int fd)
 	exit(7);
 }
 
-int main(void)
+/******************************************************************************
+ * Benchmark
+ */
+
+enum transport {
+	T_PIPE,
+	T_SOCKETPAIR,
+	T_RING,
+	NR_TRANSPORTS
+};
+
+static const char *transport_names[NR_TRANSPORTS] = {
+	[T_PIPE] = "pipe",
+	[T_SOCKETPAIR] = "socketpair",
+	[T_RING] = "ring",
+};
+
+#define RING_SIZE	(4 << 20)
+#define RING_BATCH	(64 << 10)
+
+/* iterations are capped, so that 8 B messages do not take forever */
+#define LAT_MAX_ITERS	20000
+#define TPUT_MAX_MSGS	500000
+#define MIN_ITERS	16
+
+/* the two directions between the parent and the child */
+struct chan {
+	enum transport	type;
+	int		down[2];	/* parent -> child: read end, write end */
+	int		up[2];		/* child -> parent */
+	struct spsc_ring *ring_down, *ring_up;
+};
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void write_full(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			perror("write");
+			exit(1);
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+static void read_full(int fd, char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read(fd, buf, len);
+		if (ret <= 0) {
+			if (ret < 0)
+				perror("read");
+			else
+				fprintf(stderr, "read: unexpected EOF\n");
+			exit(1);
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+static void chan_open(struct chan *ch, enum transport type)
+{
+	int sv[2];
+
+	ch->type = type;
+	switch (type) {
+	case T_PIPE:
+		if (pipe(ch->down) < 0 || pipe(ch->up) < 0) {
+			perror("pipe");
+			exit(1);
+		}
+		break;
+	case T_SOCKETPAIR:
+		/* one socket pair carries both directions */
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+			perror("socketpair");
+			exit(1);
+		}
+		ch->down[0] = ch->up[1] = sv[1];
+		ch->down[1] = ch->up[0] = sv[0];
+		break;
+	case T_RING:
+		ch->ring_down = spsc_create(RING_SIZE, RING_BATCH);
+		ch->ring_up = spsc_create(RING_SIZE, RING_BATCH);
+		break;
+	default:
+		break;
+	}
+}
+
+static void chan_close(struct chan *ch)
+{
+	switch (ch->type) {
+	case T_PIPE:
+		close(ch->down[0]);
+		close(ch->down[1]);
+		close(ch->up[0]);
+		close(ch->up[1]);
+		break;
+	case T_SOCKETPAIR:
+		close(ch->down[0]);
+		close(ch->down[1]);
+		break;
+	case T_RING:
+		spsc_destroy(ch->ring_down);
+		spsc_destroy(ch->ring_up);
+		break;
+	default:
+		break;
+	}
+}
+
+/* sends a message from the parent (down) or from the child (!down) */
+static void chan_send(struct chan *ch, int down, const char *buf, size_t len, int flush)
+{
+	if (ch->type != T_RING) {
+		write_full(down ? ch->down[1] : ch->up[1], buf, len);
+		return;
+	}
+	spsc_write(down ? ch->ring_down : ch->ring_up, buf, len);
+	if (flush)
+		spsc_flush(down ? ch->ring_down : ch->ring_up);
+}
+
+static void chan_recv(struct chan *ch, int down, char *buf, size_t len)
+{
+	if (ch->type != T_RING)
+		read_full(down ? ch->down[0] : ch->up[0], buf, len);
+	else
+		spsc_read(down ? ch->ring_down : ch->ring_up, buf, len);
+}
+
+static unsigned long nr_iters(unsigned long bytes, size_t size, unsigned long max)
+{
+	unsigned long n = bytes / size;
+
+	if (n > max)
+		n = max;
+	return n < MIN_ITERS ? MIN_ITERS : n;
+}
+
+static void reap(pid_t p)
+{
+	int status;
+
+	if (waitpid(p, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "benchmark child failed\n");
+		exit(1);
+	}
+}
+
+/*
+ * Latency: the parent sends a message, the child sends it back.
+ * Returns the one-way latency, half a round trip, in us.
+ */
+static double bench_latency(enum transport type, char *buf, size_t size, unsigned long iters)
+{
+	struct chan ch;
+	unsigned long i;
+	double start;
+	pid_t p;
+
+	chan_open(&ch, type);
+	fflush(stdout);
+	p = fork();
+	if (p < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (p == 0) {
+		for (i = 0; i < iters; i++) {
+			chan_recv(&ch, 1, buf, size);
+			chan_send(&ch, 0, buf, size, 1);
+		}
+		exit(0);
+	}
+
+	start = now_us();
+	for (i = 0; i < iters; i++) {
+		chan_send(&ch, 1, buf, size, 1);
+		chan_recv(&ch, 0, buf, size);
+	}
+	start = (now_us() - start) / iters / 2;
+
+	reap(p);
+	chan_close(&ch);
+	return start;
+}
+
+/*
+ * Throughput: the parent streams msgs messages, the child
+ * acknowledges the last one. Returns GB/s.
+ */
+static double bench_throughput(enum transport type, char *buf, size_t size, unsigned long msgs)
+{
+	struct chan ch;
+	unsigned long i;
+	double start, elapsed;
+	char ack = 0;
+	pid_t p;
+
+	chan_open(&ch, type);
+	fflush(stdout);
+	p = fork();
+	if (p < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (p == 0) {
+		for (i = 0; i < msgs; i++)
+			chan_recv(&ch, 1, buf, size);
+		chan_send(&ch, 0, &ack, 1, 1);
+		exit(0);
+	}
+
+	start = now_us();
+	for (i = 0; i < msgs; i++)
+		chan_send(&ch, 1, buf, size, i == msgs - 1);
+	chan_recv(&ch, 0, &ack, 1);
+	elapsed = now_us() - start;
+
+	reap(p);
+	chan_close(&ch);
+	return (double)size * msgs / elapsed / 1e3;
+}
+
+static void bench(size_t max_size, unsigned long total_mb)
+{
+	unsigned long bytes = total_mb << 20;
+	size_t size;
+	char *buf;
+	int t;
+
+	buf = malloc(max_size);
+	if (buf == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		exit(1);
+	}
+	memset(buf, 0x5a, max_size);
+
+	printf("%-11s %9s %12s %10s\n", "transport", "size", "latency_us", "GB/s");
+	for (size = 8; size <= max_size; size *= 8) {
+		for (t = 0; t < NR_TRANSPORTS; t++)
+			printf("%-11s %9zu %12.2f %10.3f\n", transport_names[t], size,
+				bench_latency(t, buf, size, nr_iters(bytes, size, LAT_MAX_ITERS)),
+				bench_throughput(t, buf, size, nr_iters(bytes, size, TPUT_MAX_MSGS)));
+		/* the sizes go 8, 64, ..., 256 KiB, then 1 MiB */
+		if (size < max_size && size * 8 > max_size)
+			size = max_size / 8;
+	}
+	free(buf);
+}
+
+/*
+ * Bulk transfers: the parent sends total_mb MB through a pipe, from two
+ * buffers it alternates between, and the child writes them to out_file.
+ */
+
+#define BULK_BUFFER	(4 << 20)
+
+static double bench_bulk(int send_pages, int splice_out, const char *out_file,
+	char *bufs[2], unsigned long total_mb)
+{
+	unsigned long bytes = total_mb << 20, sent;
+	size_t len;
+	double start;
+	int pfd[2], fd, i;
+	ssize_t ret;
+	pid_t p;
+
+	if (pipe_bulk(pfd) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	fflush(stdout);
+	start = now_us();
+	p = fork();
+	if (p < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (p == 0) {
+		close(pfd[1]);
+		fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror(out_file);
+			exit(1);
+		}
+		if (splice_out) {
+			if (pipe_splice_out(pfd[0], fd, bytes) != bytes)
+				exit(1);
+		} else {
+			for (sent = 0; sent < bytes; sent += ret) {
+				ret = read(pfd[0], bufs[0], BULK_BUFFER);
+				if (ret <= 0)
+					exit(1);
+				write_full(fd, bufs[0], ret);
+			}
+		}
+		close(fd);
+		exit(0);
+	}
+
+	close(pfd[0]);
+	for (sent = 0, i = 0; sent < bytes; sent += len, i ^= 1) {
+		len = bytes - sent < BULK_BUFFER ? bytes - sent : BULK_BUFFER;
+		if (send_pages)
+			pipe_send_pages(pfd[1], bufs[i], len);
+		else
+			write_full(pfd[1], bufs[i], len);
+	}
+	close(pfd[1]);
+	reap(p);
+
+	return bytes / (now_us() - start) / 1e3;
+}
+
+static void bench_zerocopy(const char *out_file, unsigned long total_mb)
+{
+	static const char *writer_names[2] = { "write", "vmsplice" };
+	static const char *reader_names[2] = { "read+write", "splice" };
+	char *bufs[2];
+	int w, r;
+
+	bufs[0] = pipe_buffer_alloc(BULK_BUFFER);
+	bufs[1] = pipe_buffer_alloc(BULK_BUFFER);
+	memset(bufs[0], 0x5a, BULK_BUFFER);
+	memset(bufs[1], 0xa5, BULK_BUFFER);
+
+	printf("%lu MB to %s, in %d KiB buffers\n", total_mb, out_file, BULK_BUFFER >> 10);
+	printf("%-10s %-12s %10s\n", "writer", "reader", "GB/s");
+	for (w = 0; w < 2; w++)
+		for (r = 0; r < 2; r++)
+			printf("%-10s %-12s %10.3f\n", writer_names[w], reader_names[r],
+				bench_bulk(w, r, out_file, bufs, total_mb));
+
+	pipe_buffer_free(bufs[0], BULK_BUFFER);
+	pipe_buffer_free(bufs[1], BULK_BUFFER);
+}
+
+static void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-b [-m MAX_SIZE] [-n MB]] [-z [-o OUT_FILE] [-n MB]]\n\n"
+			"    -b: benchmark pipes, socketpairs and the shared-memory ring\n"
+			"    -m MAX_SIZE: largest message size in bytes (default 1048576)\n"
+			"    -n MB: data per size and transport (default 64)\n"
+			"    -z: benchmark bulk pipe transfers, copying against vmsplice/splice\n"
+			"    -o OUT_FILE: where the reader writes the data (default /dev/null)\n",
+			argv0);
+	exit(1);
+}
+
+static int demo(void)
 {
 	pid_t p;
 	int pfd[2];
@@ -78,3 +456,48 @@ int main(void)
 
 	return 0;
 }
+
+int main(int argc, char *argv[])
+{
+	size_t max_size = 1 << 20;
+	unsigned long total_mb = 64;
+	const char *out_file = "/dev/null";
+	int opt, do_bench = 0, do_zerocopy = 0;
+
+	while ((opt = getopt(argc, argv, "bm:n:zo:")) != -1) {
+		switch (opt) {
+		case 'b':
+			do_bench = 1;
+			break;
+		case 'z':
+			do_zerocopy = 1;
+			break;
+		case 'o':
+			out_file = optarg;
+			break;
+		case 'm':
+			max_size = strtoul(optarg, NULL, 10);
+			if (max_size < 8)
+				usage(argv[0]);
+			break;
+		case 'n':
+			total_mb = strtoul(optarg, NULL, 10);
+			if (total_mb == 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	if (!do_bench && !do_zerocopy)
+		return demo();
+
+	if (do_bench)
+		bench(max_size, total_mb);
+	if (do_zerocopy)
+		bench_zerocopy(out_file, total_mb);
+	return 0;
+}
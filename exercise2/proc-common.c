@@ -1,14 +1,20 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
 
 #include <sys/types.h>
 #include <sys/prctl.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "proc-common.h"
 
@@ -26,12 +32,143 @@ wait_forever(void)
  */
 void compute(int count)
 {
-	long i;
-	volatile long junk;
+	cpu_burn(BURN_CPU, count * 1000L);
+}
+
+
+/******************************************************************************
+ * Calibrated CPU burn
+ */
+
+/* work is done in units of BURN_STEPS steps, the clock is read once per slice */
+#define BURN_STEPS		64
+#define BURN_SLICE_US		200
+#define BURN_CALIBRATE_US	5000
+
+#define BURN_CACHE_BYTES	(16 << 10)
+#define BURN_MEMORY_BYTES	(64 << 20)
+
+static double burn_units_per_us[NR_BURN_KINDS];
+static unsigned *burn_chain[NR_BURN_KINDS];
+
+static volatile unsigned long burn_sink;
+
+static double burn_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * A single random cycle through all the entries (Sattolo's algorithm),
+ * so that every step of the chase depends on the previous one and the
+ * prefetcher cannot guess the next.
+ */
+static unsigned *burn_make_chain(size_t bytes)
+{
+	size_t i, j, n = bytes / sizeof(unsigned);
+	unsigned *chain, tmp, seed = 12345;
+
+	chain = malloc(bytes);
+	if (chain == NULL) {
+		fprintf(stderr, "cpu_burn: allocation failed\n");
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		chain[i] = i;
+	for (i = n - 1; i > 0; i--) {
+		seed = seed * 1103515245 + 12345;
+		j = ((size_t)seed << 16 ^ seed >> 8) % i;
+		tmp = chain[i];
+		chain[i] = chain[j];
+		chain[j] = tmp;
+	}
+	return chain;
+}
+
+static void burn_units(enum burn_kind kind, unsigned long units)
+{
+	unsigned long x = burn_sink, i, j;
+	unsigned *chain = burn_chain[kind];
+
+	switch (kind) {
+	case BURN_CPU:
+		for (i = 0; i < units; i++)
+			for (j = 0; j < BURN_STEPS; j++)
+				x = x * 6364136223846793005UL + 1442695040888963407UL;
+		break;
+	case BURN_CACHE:
+	case BURN_MEMORY:
+		x = chain[x % 2];
+		for (i = 0; i < units; i++)
+			for (j = 0; j < BURN_STEPS; j++)
+				x = chain[x];
+		break;
+	default:
+		break;
+	}
+	burn_sink = x;
+}
+
+static void burn_calibrate_kind(enum burn_kind kind)
+{
+	unsigned long units = 1, done = 0;
+	double start, elapsed;
+
+	if (kind == BURN_CACHE)
+		burn_chain[kind] = burn_make_chain(BURN_CACHE_BYTES);
+	else if (kind == BURN_MEMORY)
+		burn_chain[kind] = burn_make_chain(BURN_MEMORY_BYTES);
+
+	/* one pass to warm up the caches (or to fill the TLB with misses) */
+	burn_units(kind, 64);
+
+	start = burn_now_us();
+	do {
+		burn_units(kind, units);
+		done += units;
+		units *= 2;
+		elapsed = burn_now_us() - start;
+	} while (elapsed < BURN_CALIBRATE_US);
+
+	burn_units_per_us[kind] = done / elapsed;
+}
+
+void
+cpu_burn_calibrate(void)
+{
+	int kind;
+
+	for (kind = 0; kind < NR_BURN_KINDS; kind++)
+		if (burn_units_per_us[kind] == 0)
+			burn_calibrate_kind(kind);
+}
+
+void
+cpu_burn(enum burn_kind kind, long us)
+{
+	double start, left;
+	unsigned long units;
+
+	if (kind < 0 || kind >= NR_BURN_KINDS) {
+		fprintf(stderr, "%s: invalid kind %d\n", __func__, kind);
+		exit(1);
+	}
+	if (burn_units_per_us[kind] == 0)
+		burn_calibrate_kind(kind);
 
-	junk = 0;
-	for (i = 0; i < count * 1000000; i++) {
-		junk++;
+	/*
+	 * The calibration only sizes the slices: the clock decides when to
+	 * stop, so a wrong estimate costs at most one slice.
+	 */
+	start = burn_now_us();
+	while ((left = us - (burn_now_us() - start)) > 0) {
+		if (left > BURN_SLICE_US)
+			left = BURN_SLICE_US;
+		units = left * burn_units_per_us[kind];
+		burn_units(kind, units > 0 ? units : 1);
 	}
 }
 
@@ -48,6 +185,7 @@ change_pname(const char *new_name)
 		perror("prctl set_name");
 		exit(1);
 	}
+	proc_trace(PROC_EV_NAME, 0);
 }
 
 /*
@@ -109,6 +247,9 @@ wait_for_ready_children(int cnt)
 	}
 }
 
+static double trace_now_us(void);
+static void trace_span(enum proc_event ev, long long arg, double start_us);
+
 /*
  * Print the process tree rooted at process with PID p.
  */
@@ -117,15 +258,18 @@ show_pstree(pid_t p)
 {
 	int ret;
 	char cmd[1024];
+	double start;
 
 	snprintf(cmd, sizeof(cmd), "echo; echo; pstree -G -c -p %ld; echo; echo",
 		(long)p);
 	cmd[sizeof(cmd)-1] = '\0';
+	start = trace_now_us();
 	ret = system(cmd);
 	if (ret < 0) {
 		perror("system");
 		exit(104);
 	}
+	trace_span(PROC_EV_PSTREE, p, start);
 }
 
 
@@ -155,3 +299,371 @@ void *create_shared_memory_area(unsigned int numbytes)
 
 	return addr;
 }
+
+
+/******************************************************************************
+ * Bulk pipe transfers
+ */
+
+/* large enough that a multi-MB buffer goes through in a few system calls */
+#define PIPE_BULK_SIZE	(1 << 20)
+
+int
+pipe_bulk(int pfd[2])
+{
+	int size;
+
+	if (pipe(pfd) < 0)
+		return -1;
+
+	/* above /proc/sys/fs/pipe-max-size this fails, keep the default then */
+	fcntl(pfd[1], F_SETPIPE_SZ, PIPE_BULK_SIZE);
+	size = fcntl(pfd[1], F_GETPIPE_SZ);
+	return size > 0 ? size : sysconf(_SC_PAGE_SIZE);
+}
+
+void *
+pipe_buffer_alloc(size_t len)
+{
+	void *buf;
+
+	buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		perror("pipe_buffer_alloc: mmap failed");
+		exit(1);
+	}
+	return buf;
+}
+
+void
+pipe_buffer_free(void *buf, size_t len)
+{
+	munmap(buf, len);
+}
+
+void
+pipe_send_pages(int fd, const void *buf, size_t len)
+{
+	struct iovec iov = { (void *)buf, len };
+	ssize_t ret;
+	int fallback = 0;
+
+	while (iov.iov_len > 0) {
+		if (!fallback) {
+			ret = vmsplice(fd, &iov, 1, 0);
+			if (ret < 0 && errno == EBADF) {
+				/* not a pipe */
+				fallback = 1;
+				continue;
+			}
+		} else {
+			ret = write(fd, iov.iov_base, iov.iov_len);
+		}
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("pipe_send_pages");
+			exit(1);
+		}
+		iov.iov_base = (char *)iov.iov_base + ret;
+		iov.iov_len -= ret;
+	}
+}
+
+/* the read() and write() fallback of pipe_splice_out() */
+static size_t pipe_copy_out(int fd, int out_fd, size_t len)
+{
+	char buf[65536];
+	size_t done = 0, chunk;
+	ssize_t ret, off, w;
+
+	while (done < len) {
+		chunk = len - done < sizeof(buf) ? len - done : sizeof(buf);
+		ret = read(fd, buf, chunk);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			perror("pipe_splice_out: read");
+			exit(1);
+		}
+		if (ret == 0)
+			break;
+		for (off = 0; off < ret; off += w) {
+			w = write(out_fd, buf + off, ret - off);
+			if (w < 0) {
+				if (errno != EINTR) {
+					perror("pipe_splice_out: write");
+					exit(1);
+				}
+				w = 0;
+			}
+		}
+		done += ret;
+	}
+	return done;
+}
+
+size_t
+pipe_splice_out(int fd, int out_fd, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = splice(fd, NULL, out_fd, NULL, len - done, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EINVAL && done == 0)
+				/* out_fd cannot be spliced to */
+				return pipe_copy_out(fd, out_fd, len);
+			perror("pipe_splice_out");
+			exit(1);
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+
+/******************************************************************************
+ * Process lifecycle tracing
+ */
+
+#define TRACE_DEFAULT_EVENTS	(1 << 18)
+
+struct trace_event {
+	double		ts_us;
+	double		dur_us;		/* only for PROC_EV_FORK and PROC_EV_PSTREE */
+	pid_t		pid;
+	int		type;
+	long long	arg;
+	char		name[16];	/* process name at the time */
+};
+
+struct trace_ring {
+	unsigned long		next;		/* events ever recorded */
+	unsigned long		size;
+	pid_t			owner;
+	char			filename[256];
+	struct trace_event	events[];
+};
+
+static struct trace_ring *trace_ring;
+
+static const char *proc_event_names[NR_PROC_EVENTS] = {
+	[PROC_EV_FORK] = "fork",
+	[PROC_EV_START] = "start",
+	[PROC_EV_PSTREE] = "pstree",
+	[PROC_EV_NAME] = "name",
+	[PROC_EV_STOP] = "SIGSTOP",
+	[PROC_EV_CONT] = "SIGCONT",
+	[PROC_EV_RESULT] = "result",
+	[PROC_EV_EXIT] = "exit",
+	[PROC_EV_REAP] = "reap",
+};
+
+static double trace_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void trace_record(enum proc_event ev, long long arg, double ts_us, double dur_us)
+{
+	struct trace_event *e;
+	unsigned long idx;
+
+	idx = __atomic_fetch_add(&trace_ring->next, 1, __ATOMIC_RELAXED);
+	e = &trace_ring->events[idx % trace_ring->size];
+	e->ts_us = ts_us;
+	e->dur_us = dur_us;
+	e->pid = getpid();
+	e->type = ev;
+	e->arg = arg;
+	if (prctl(PR_GET_NAME, e->name) == -1)
+		e->name[0] = '\0';
+}
+
+void
+proc_trace(enum proc_event ev, long long arg)
+{
+	if (trace_ring == NULL)
+		return;
+	trace_record(ev, arg, trace_now_us(), 0);
+}
+
+/* records an event that started at start_us and ends now, if tracing is on */
+static void trace_span(enum proc_event ev, long long arg, double start_us)
+{
+	if (trace_ring == NULL)
+		return;
+	trace_record(ev, arg, start_us, trace_now_us() - start_us);
+}
+
+pid_t
+proc_trace_fork(void)
+{
+	double start;
+	pid_t pid;
+
+	if (trace_ring == NULL)
+		return fork();
+
+	start = trace_now_us();
+	pid = fork();
+	if (pid > 0)
+		trace_record(PROC_EV_FORK, pid, start, trace_now_us() - start);
+	else if (pid == 0)
+		proc_trace(PROC_EV_START, getppid());
+	return pid;
+}
+
+static int cmp_trace_event(const void *a, const void *b)
+{
+	const struct trace_event *x = a, *y = b;
+
+	if (x->pid != y->pid)
+		return x->pid < y->pid ? -1 : 1;
+	return (x->ts_us > y->ts_us) - (x->ts_us < y->ts_us);
+}
+
+static void trace_slice(FILE *f, const char *name, pid_t pid, double from, double to,
+	double base, int *first)
+{
+	if (from < 0 || to < from)
+		return;
+	fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%ld,"
+		"\"ts\":%.3f,\"dur\":%.3f}", *first ? "" : ",", name,
+		(long)trace_ring->owner, (long)pid, from - base, to - from);
+	*first = 0;
+}
+
+/*
+ * All processes of the tree share one Chrome "process", with one
+ * "thread" per process. Besides the events themselves, every process
+ * gets the slices build (start to SIGSTOP), stopped (SIGSTOP to SIGCONT)
+ * and teardown (SIGCONT to exit).
+ */
+static void trace_dump(void)
+{
+	unsigned long n = trace_ring->next, first_idx = 0, i;
+	struct trace_event *ev, *e;
+	double base, start = -1, stop = -1, cont = -1;
+	char name[sizeof(ev->name)];
+	unsigned j;
+	FILE *f;
+	int first = 1;
+
+	if (n > trace_ring->size) {
+		fprintf(stderr, "proc_trace: ring full, the first %lu events are lost\n",
+			n - trace_ring->size);
+		first_idx = n - trace_ring->size;
+	}
+	n -= first_idx;
+	ev = malloc((n + 1) * sizeof(*ev));
+	if (ev == NULL) {
+		fprintf(stderr, "proc_trace: out of memory\n");
+		return;
+	}
+	for (i = 0; i < n; i++)
+		ev[i] = trace_ring->events[(first_idx + i) % trace_ring->size];
+	qsort(ev, n, sizeof(*ev), cmp_trace_event);
+
+	f = fopen(trace_ring->filename, "w");
+	if (f == NULL) {
+		perror(trace_ring->filename);
+		free(ev);
+		return;
+	}
+
+	base = n ? ev[0].ts_us : 0;
+	for (i = 0; i < n; i++)
+		if (ev[i].ts_us < base)
+			base = ev[i].ts_us;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (i = 0; i < n; i++) {
+		e = &ev[i];
+		if (i == 0 || ev[i - 1].pid != e->pid)
+			start = stop = cont = -1;
+
+		if (e->type == PROC_EV_FORK || e->type == PROC_EV_PSTREE)
+			fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%ld,"
+				"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"%s\":%lld}}",
+				first ? "" : ",", proc_event_names[e->type],
+				(long)trace_ring->owner, (long)e->pid, e->ts_us - base, e->dur_us,
+				e->type == PROC_EV_FORK ? "child" : "pid", e->arg);
+		else
+			fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%ld,"
+				"\"tid\":%ld,\"ts\":%.3f,\"args\":{\"arg\":%lld}}",
+				first ? "" : ",", proc_event_names[e->type],
+				(long)trace_ring->owner, (long)e->pid, e->ts_us - base, e->arg);
+		first = 0;
+
+		switch (e->type) {
+		case PROC_EV_START:
+			start = e->ts_us;
+			break;
+		case PROC_EV_STOP:
+			stop = e->ts_us;
+			trace_slice(f, "build", e->pid, start, stop, base, &first);
+			break;
+		case PROC_EV_CONT:
+			cont = e->ts_us;
+			trace_slice(f, "stopped", e->pid, stop, cont, base, &first);
+			break;
+		case PROC_EV_EXIT:
+			trace_slice(f, "teardown", e->pid, cont, e->ts_us, base, &first);
+			break;
+		}
+
+		/* the last name of every process names its track */
+		if (i + 1 == n || ev[i + 1].pid != e->pid) {
+			for (j = 0; j < sizeof(name) - 1 && e->name[j] != '\0'; j++)
+				name[j] = (e->name[j] == '"' || e->name[j] == '\\' ||
+					(unsigned char)e->name[j] < ' ') ? '_' : e->name[j];
+			name[j] = '\0';
+			fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,"
+				"\"tid\":%ld,\"args\":{\"name\":\"%s (%ld)\"}}",
+				(long)trace_ring->owner, (long)e->pid, name, (long)e->pid);
+		}
+	}
+	fprintf(f, "\n]}\n");
+	if (fclose(f) != 0)
+		perror(trace_ring->filename);
+
+	free(ev);
+}
+
+static void trace_atexit(void)
+{
+	if (trace_ring == NULL)
+		return;
+	proc_trace(PROC_EV_EXIT, 0);
+	if (getpid() == trace_ring->owner)
+		trace_dump();
+}
+
+void
+proc_trace_init(const char *filename, unsigned nr_events)
+{
+	if (nr_events == 0)
+		nr_events = TRACE_DEFAULT_EVENTS;
+
+	trace_ring = create_shared_memory_area(sizeof(*trace_ring) +
+		nr_events * sizeof(struct trace_event));
+	trace_ring->size = nr_events;
+	trace_ring->owner = getpid();
+	snprintf(trace_ring->filename, sizeof(trace_ring->filename), "%s", filename);
+
+	if (atexit(trace_atexit) != 0) {
+		fprintf(stderr, "proc_trace_init: atexit failed\n");
+		exit(1);
+	}
+	proc_trace(PROC_EV_START, getppid());
+}
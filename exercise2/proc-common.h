@@ -5,9 +5,32 @@
  * Helper Functions
  */
 
-/* does useless computation */
+/* does useless computation, for count ms of CPU time (see cpu_burn()) */
 void compute(int count);
 
+/*
+ * Calibrated busy work: cpu_burn() runs for a given amount of CPU time
+ * of the calling thread (CLOCK_THREAD_CPUTIME_ID), so it takes the same
+ * time whatever the CPU, the compiler or the clock frequency, and time
+ * the thread spends preempted does not count.
+ */
+enum burn_kind {
+	BURN_CPU,		/* arithmetic in registers */
+	BURN_CACHE,		/* pointer chasing in a buffer that fits in L1 */
+	BURN_MEMORY,		/* pointer chasing in a buffer far bigger than the caches */
+	NR_BURN_KINDS
+};
+
+/*
+ * Measures how much work of each kind fits in a microsecond. cpu_burn()
+ * calibrates on first use; calling this at startup keeps it out of the
+ * timings, and children forked afterwards inherit the results.
+ */
+void cpu_burn_calibrate(void);
+
+/* burns us microseconds of CPU time with work of the given kind */
+void cpu_burn(enum burn_kind kind, long us);
+
 /* Does nothing and never returns. */
 void wait_forever(void);
 
@@ -36,4 +59,78 @@ void show_pstree(pid_t p);
  */
 void *create_shared_memory_area(unsigned int numbytes);
 
+/*
+ * Bulk transfers through pipes, for buffers of megabytes.
+ *
+ * write() and read() copy every byte into the kernel and out again.
+ * pipe_send_pages() uses vmsplice() instead, so the pipe refers to the
+ * pages of the buffer rather than holding a copy of them, and
+ * pipe_splice_out() moves what is in the pipe to a file or socket with
+ * splice(), without passing it through user space at all.
+ *
+ * Since the pipe refers to the buffer, the writer must not change it
+ * until the reader has consumed it. If the reader read()s the pipe, or
+ * splices it into a regular file, both of which copy the data out, it is
+ * safe to reuse a buffer once at least pipe size bytes from other buffers
+ * have been sent after it, e.g. by alternating between two buffers of
+ * pipe size or more. Not so if it splices into a socket: TCP holds on to
+ * the pages until the peer has acknowledged them, long after they have
+ * left the pipe, and nothing tells the writer when that is. Data bound
+ * for a socket should be sent with write(), which copies it, instead.
+ */
+
+/* creates a pipe as pipe() does, grown for bulk transfers; returns its size */
+int pipe_bulk(int pfd[2]);
+
+/* page-aligned buffers, which vmsplice() can pass on without copying */
+void *pipe_buffer_alloc(size_t len);
+void pipe_buffer_free(void *buf, size_t len);
+
+/*
+ * Writes len bytes of buf to the pipe fd with vmsplice(), falling back
+ * to write() if fd is not a pipe. Returns once all of them are in the pipe.
+ */
+void pipe_send_pages(int fd, const void *buf, size_t len);
+
+/*
+ * Moves len bytes from the pipe fd to out_fd (a file or a socket) with
+ * splice(), falling back to read() and write() if out_fd does not
+ * support it. Returns the number of bytes moved, less than len only
+ * on end of file.
+ */
+size_t pipe_splice_out(int fd, int out_fd, size_t len);
+
+/*
+ * Process lifecycle tracing, off unless proc_trace_init() is called.
+ * Every process of the tree appends timestamped events to a ring in
+ * shared memory, and the process that called proc_trace_init() writes
+ * them out in Chrome trace format (chrome://tracing, Perfetto) when it
+ * exits. Exits are recorded by an atexit() handler, so they are seen
+ * for exit() but not for _exit() or a fatal signal.
+ */
+enum proc_event {
+	PROC_EV_FORK,		/* parent side, arg: child pid */
+	PROC_EV_START,		/* child side, arg: parent pid */
+	PROC_EV_PSTREE,		/* show_pstree(), system() and all, arg: the root pid */
+	PROC_EV_NAME,		/* change_pname(), the new name */
+	PROC_EV_STOP,		/* about to raise SIGSTOP, i.e. ready */
+	PROC_EV_CONT,		/* woken up by SIGCONT */
+	PROC_EV_RESULT,		/* result written, arg: the value */
+	PROC_EV_EXIT,
+	PROC_EV_REAP,		/* arg: pid of the reaped child */
+	NR_PROC_EVENTS
+};
+
+/*
+ * Starts tracing into a ring of nr_events events (0 for the default),
+ * to be written to filename.
+ */
+void proc_trace_init(const char *filename, unsigned nr_events);
+
+/* records an event of the calling process, if tracing is on */
+void proc_trace(enum proc_event ev, long long arg);
+
+/* fork(), recording how long it took in the parent and the start of the child */
+pid_t proc_trace_fork(void);
+
 #endif /* PROC_COMMON_H */
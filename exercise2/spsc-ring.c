@@ -0,0 +1,231 @@
+/*
+ * spsc-ring.c
+ *
+ * Single-producer, single-consumer byte ring in shared memory.
+ *
+ * head (bytes written) is only stored by the writer and tail (bytes
+ * read) only by the reader, each on a cache line of its own. Each side
+ * also keeps a private copy of the other side's index and only reloads
+ * it when the ring looks full or empty, so in steady state the shared
+ * lines move once per batch rather than once per write.
+ *
+ * A side that finds nothing to do spins for a while and then sleeps on
+ * a futex, after setting its "waiting" flag. The other side checks the
+ * flag after publishing and makes the futex call only when it is set,
+ * so no system calls are made while both sides are busy.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "spsc-ring.h"
+#include "proc-common.h"
+
+#define CACHE_LINE	64
+
+/* polls before going to sleep on the futex, if there is a CPU to poll on */
+#define SPSC_SPIN	256
+
+struct spsc_ring {
+	/* published indices */
+	_Alignas(CACHE_LINE) atomic_ulong head;
+	_Alignas(CACHE_LINE) atomic_ulong tail;
+
+	/* set by a side before it sleeps, cleared by the side that wakes it */
+	_Alignas(CACHE_LINE) atomic_int reader_waiting;
+	_Alignas(CACHE_LINE) atomic_int writer_waiting;
+
+	/* writer only */
+	_Alignas(CACHE_LINE) unsigned long w_head;
+	unsigned long w_published;
+	unsigned long w_cached_tail;
+
+	/* reader only */
+	_Alignas(CACHE_LINE) unsigned long r_tail;
+	unsigned long r_cached_head;
+
+	/* read-only after spsc_create() */
+	_Alignas(CACHE_LINE) size_t size;
+	size_t mask;
+	size_t batch;
+	size_t mapped;
+	int spin;
+
+	_Alignas(CACHE_LINE) unsigned char data[];
+};
+
+static void futex_wait(atomic_int *addr, int val)
+{
+	/* shared between processes, so no FUTEX_PRIVATE_FLAG */
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_int *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static void wake_if_waiting(atomic_int *waiting)
+{
+	/*
+	 * Pairs with the fence in wait_until(): either the sleeper sees
+	 * the new index, or this sees its flag.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(waiting, memory_order_relaxed) &&
+	    atomic_exchange(waiting, 0))
+		futex_wake(waiting);
+}
+
+/* waits until *idx != old */
+static unsigned long wait_until(atomic_ulong *idx, unsigned long old, atomic_int *waiting,
+	int spin)
+{
+	unsigned long now;
+	int i;
+
+	for (i = 0; i < spin; i++) {
+		now = atomic_load_explicit(idx, memory_order_acquire);
+		if (now != old)
+			return now;
+		cpu_relax();
+	}
+
+	for (;;) {
+		atomic_store(waiting, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		now = atomic_load_explicit(idx, memory_order_acquire);
+		if (now != old) {
+			atomic_store(waiting, 0);
+			return now;
+		}
+		/* returns at once if the other side has cleared the flag */
+		futex_wait(waiting, 1);
+	}
+}
+
+struct spsc_ring *
+spsc_create(size_t size, size_t batch)
+{
+	struct spsc_ring *ring;
+	size_t ring_size = CACHE_LINE, mapped;
+
+	while (ring_size < size)
+		ring_size *= 2;
+	mapped = sizeof(*ring) + ring_size;
+	if (mapped > -1U) {
+		fprintf(stderr, "spsc_create: ring too big\n");
+		exit(1);
+	}
+
+	/* zero-filled, so all indices and flags start at 0 */
+	ring = create_shared_memory_area(mapped);
+	ring->size = ring_size;
+	ring->mask = ring_size - 1;
+	ring->batch = batch < ring_size ? batch : ring_size;
+	ring->mapped = mapped;
+	/* on a single CPU the other side cannot run while this one spins */
+	ring->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPSC_SPIN : 0;
+
+	return ring;
+}
+
+void
+spsc_destroy(struct spsc_ring *ring)
+{
+	munmap(ring, ring->mapped);
+}
+
+void
+spsc_flush(struct spsc_ring *ring)
+{
+	if (ring->w_head == ring->w_published)
+		return;
+	atomic_store_explicit(&ring->head, ring->w_head, memory_order_release);
+	ring->w_published = ring->w_head;
+	wake_if_waiting(&ring->reader_waiting);
+}
+
+void
+spsc_write(struct spsc_ring *ring, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t room, n, off, first;
+
+	while (len > 0) {
+		room = ring->size - (ring->w_head - ring->w_cached_tail);
+		if (room == 0) {
+			ring->w_cached_tail = atomic_load_explicit(&ring->tail,
+				memory_order_acquire);
+			room = ring->size - (ring->w_head - ring->w_cached_tail);
+		}
+		if (room == 0) {
+			/* the reader can only make room for what it can see */
+			spsc_flush(ring);
+			ring->w_cached_tail = wait_until(&ring->tail, ring->w_cached_tail,
+				&ring->writer_waiting, ring->spin);
+			continue;
+		}
+
+		n = len < room ? len : room;
+		off = ring->w_head & ring->mask;
+		first = n < ring->size - off ? n : ring->size - off;
+		memcpy(ring->data + off, p, first);
+		memcpy(ring->data, p + first, n - first);
+		ring->w_head += n;
+		p += n;
+		len -= n;
+
+		if (ring->w_head - ring->w_published >= ring->batch)
+			spsc_flush(ring);
+	}
+}
+
+void
+spsc_read(struct spsc_ring *ring, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+	size_t avail, n, off, first;
+
+	while (len > 0) {
+		avail = ring->r_cached_head - ring->r_tail;
+		if (avail == 0) {
+			ring->r_cached_head = atomic_load_explicit(&ring->head,
+				memory_order_acquire);
+			avail = ring->r_cached_head - ring->r_tail;
+		}
+		if (avail == 0) {
+			/* let a waiting writer refill what was read so far */
+			atomic_store_explicit(&ring->tail, ring->r_tail, memory_order_release);
+			wake_if_waiting(&ring->writer_waiting);
+			ring->r_cached_head = wait_until(&ring->head, ring->r_tail,
+				&ring->reader_waiting, ring->spin);
+			continue;
+		}
+
+		n = len < avail ? len : avail;
+		off = ring->r_tail & ring->mask;
+		first = n < ring->size - off ? n : ring->size - off;
+		memcpy(p, ring->data + off, first);
+		memcpy(p + first, ring->data, n - first);
+		ring->r_tail += n;
+		p += n;
+		len -= n;
+	}
+
+	atomic_store_explicit(&ring->tail, ring->r_tail, memory_order_release);
+	wake_if_waiting(&ring->writer_waiting);
+}
@@ -0,0 +1,46 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stddef.h>
+
+/******************************************************************************
+ * Data structure definitions
+ */
+
+/*
+ * A single-producer, single-consumer byte ring in shared memory, for
+ * one writer and one reader process (e.g. a parent and its child).
+ * Like a pipe it carries a stream of bytes, message boundaries are up
+ * to the caller.
+ */
+struct spsc_ring;
+
+
+/******************************************************************************
+ * Helper Functions
+ */
+
+/*
+ * Creates a ring of size bytes (rounded up to a power of two), before
+ * fork()ing the other side. The writer publishes what it has written
+ * once batch bytes are pending, or on spsc_flush(); 0 publishes on
+ * every write.
+ */
+struct spsc_ring *spsc_create(size_t size, size_t batch);
+
+void spsc_destroy(struct spsc_ring *ring);
+
+/*
+ * Writer side: copies len bytes into the ring, waiting for room as
+ * needed. The bytes may not be visible to the reader until the next
+ * spsc_flush().
+ */
+void spsc_write(struct spsc_ring *ring, const void *buf, size_t len);
+
+/* Writer side: publishes everything written so far. */
+void spsc_flush(struct spsc_ring *ring);
+
+/* Reader side: copies exactly len bytes out of the ring, waiting for them. */
+void spsc_read(struct spsc_ring *ring, void *buf, size_t len);
+
+#endif /* SPSC_RING_H */
@@ -0,0 +1,234 @@
+/*
+ * tree-gen.c
+ *
+ * Generates expression trees of a given size and shape,
+ * in the format get_tree_from_file() reads.
+ *
+ * The shape is built first, with the children of every node next to
+ * each other, and then written out in DFS order with an explicit
+ * stack, so that deep trees do not need deep recursion here.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tree.h"
+
+enum shape {
+	SHAPE_BALANCED,		/* complete tree of the given fanout */
+	SHAPE_SKEWED,		/* every inner node has a leaf and an inner child */
+	SHAPE_CHAIN,		/* every inner node has one child, depth = size */
+	SHAPE_WIDE,		/* the root and size - 1 leaves */
+	SHAPE_RANDOM,		/* random fanout in [1, FANOUT], random leaves */
+	NR_SHAPES
+};
+
+static const char *shape_names[NR_SHAPES] = {
+	[SHAPE_BALANCED] = "balanced",
+	[SHAPE_SKEWED] = "skewed",
+	[SHAPE_CHAIN] = "chain",
+	[SHAPE_WIDE] = "wide",
+	[SHAPE_RANDOM] = "random",
+};
+
+struct gen {
+	unsigned	*nr_children;
+	unsigned	*first;		/* id of the first child */
+	unsigned	nr_nodes;
+	char		(*names)[NODE_NAME_SIZE];
+};
+
+static void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-s SEED] [-f FANOUT] [-m MAX] <shape> <nodes> [out_file]\n\n"
+			"    Writes an expression tree of <nodes> nodes to out_file\n"
+			"    (default: standard output). <shape> is one of:\n"
+			"      balanced: complete tree, FANOUT children per node (default 2)\n"
+			"      skewed:   every inner node has a leaf and an inner node as children\n"
+			"      chain:    every inner node has a single child\n"
+			"      wide:     one root with <nodes> - 1 leaves\n"
+			"      random:   1 to FANOUT children per node (default 4)\n"
+			"    Leaves are random integers in [-MAX, MAX] (default 9).\n",
+			argv0);
+	exit(1);
+}
+
+static enum shape shape_of(char *name)
+{
+	int i;
+
+	for (i = 0; i < NR_SHAPES; i++)
+		if (strcmp(name, shape_names[i]) == 0)
+			return i;
+
+	fprintf(stderr, "`%s' is not a valid shape\n", name);
+	exit(1);
+}
+
+/* node id gets n children, the next ids not taken yet */
+static void add_children(struct gen *g, unsigned id, unsigned n, unsigned *next)
+{
+	g->nr_children[id] = n;
+	g->first[id] = *next;
+	*next += n;
+}
+
+static void build_shape(struct gen *g, enum shape shape, unsigned fanout)
+{
+	unsigned i, n = g->nr_nodes, next = 1, k;
+
+	for (i = 0; i < n; i++)
+		g->nr_children[i] = 0;
+
+	switch (shape) {
+	case SHAPE_BALANCED:
+		for (i = 0; next < n; i++)
+			add_children(g, i, n - next < fanout ? n - next : fanout, &next);
+		break;
+	case SHAPE_SKEWED:
+		/* i is inner: i + 1 is a leaf, i + 2 the next inner node */
+		for (i = 0; next < n; i += 2)
+			add_children(g, i, n - next < 2 ? n - next : 2, &next);
+		break;
+	case SHAPE_CHAIN:
+		for (i = 0; next < n; i++)
+			add_children(g, i, 1, &next);
+		break;
+	case SHAPE_WIDE:
+		add_children(g, 0, n - 1, &next);
+		break;
+	case SHAPE_RANDOM:
+		/*
+		 * Nodes are expanded in BFS order, a third of them stay leaves,
+		 * but the last node that can still be expanded always is.
+		 */
+		for (i = 0; next < n; i++) {
+			if (i != 0 && i + 1 < next && rand() % 3 == 0)
+				continue;
+			k = 1 + rand() % fanout;
+			add_children(g, i, n - next < k ? n - next : k, &next);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void name_nodes(struct gen *g, enum shape shape, long max)
+{
+	static const char *ops = "+*-";
+	unsigned i;
+
+	for (i = 0; i < g->nr_nodes; i++) {
+		if (g->nr_children[i] == 0)
+			snprintf(g->names[i], NODE_NAME_SIZE, "%d",
+				(int)(rand() % (2 * max + 1) - max));
+		else if (shape == SHAPE_RANDOM)
+			snprintf(g->names[i], NODE_NAME_SIZE, "%c", ops[rand() % 3]);
+		else if (shape == SHAPE_CHAIN)
+			snprintf(g->names[i], NODE_NAME_SIZE, "-");
+		else
+			snprintf(g->names[i], NODE_NAME_SIZE, "+");
+	}
+}
+
+static void write_tree(struct gen *g, FILE *out)
+{
+	unsigned *stack, sp = 0, id, i;
+
+	stack = malloc(g->nr_nodes * sizeof(*stack));
+	if (stack == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		exit(1);
+	}
+
+	stack[sp++] = 0;
+	while (sp > 0) {
+		id = stack[--sp];
+		fprintf(out, "%s\n%u\n", g->names[id], g->nr_children[id]);
+		for (i = 0; i < g->nr_children[id]; i++)
+			fprintf(out, "%s\n", g->names[g->first[id] + i]);
+		fprintf(out, "\n");
+
+		/* pushed in reverse, so that the first child comes out first */
+		for (i = g->nr_children[id]; i > 0; i--)
+			stack[sp++] = g->first[id] + i - 1;
+	}
+	free(stack);
+}
+
+int main(int argc, char *argv[])
+{
+	struct gen g;
+	enum shape shape;
+	unsigned seed = 1, fanout = 0;
+	long max = 9, nodes;
+	FILE *out = stdout;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:f:m:")) != -1) {
+		switch (opt) {
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			fanout = strtoul(optarg, NULL, 10);
+			if (fanout == 0)
+				usage(argv[0]);
+			break;
+		case 'm':
+			max = strtol(optarg, NULL, 10);
+			if (max < 0 || max > RAND_MAX / 2)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind < 2 || argc - optind > 3)
+		usage(argv[0]);
+
+	shape = shape_of(argv[optind]);
+	nodes = strtol(argv[optind + 1], NULL, 10);
+	if (nodes <= 0) {
+		fprintf(stderr, "`%s' is not valid for `nodes'\n", argv[optind + 1]);
+		exit(1);
+	}
+	if (fanout == 0)
+		fanout = shape == SHAPE_RANDOM ? 4 : 2;
+
+	g.nr_nodes = nodes;
+	g.nr_children = malloc(nodes * sizeof(*g.nr_children));
+	g.first = malloc(nodes * sizeof(*g.first));
+	g.names = malloc(nodes * sizeof(*g.names));
+	if (g.nr_children == NULL || g.first == NULL || g.names == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		exit(1);
+	}
+
+	srand(seed);
+	build_shape(&g, shape, fanout);
+	name_nodes(&g, shape, max);
+
+	if (argc - optind == 3) {
+		out = fopen(argv[optind + 2], "w");
+		if (out == NULL) {
+			perror(argv[optind + 2]);
+			exit(1);
+		}
+	}
+	fprintf(out, "# %s tree of %ld nodes, generated by tree-gen\n\n",
+		shape_names[shape], nodes);
+	write_tree(&g, out);
+	if (fclose(out) != 0) {
+		perror("fclose");
+		exit(1);
+	}
+
+	free(g.nr_children);
+	free(g.first);
+	free(g.names);
+	return 0;
+}
@@ -169,6 +169,27 @@ parse_node(FILE *file, struct tree_node *node)
 }
 
 
+static void
+free_children(struct tree_node *node)
+{
+	int i;
+
+	if (node->nr_children == 0)
+		return;
+	for (i=0; i < node->nr_children; i++)
+		free_children(node->children + i);
+	free(node->children);
+}
+
+void
+free_tree(struct tree_node *root)
+{
+	if (root == NULL)
+		return;
+	free_children(root);
+	free(root);
+}
+
 struct tree_node *
 get_tree_from_file(const char *filename)
 {
@@ -23,4 +23,7 @@ struct tree_node *get_tree_from_file(const char *filename);
 
 void print_tree(struct tree_node *root);
 
+/* frees a tree returned by get_tree_from_file() */
+void free_tree(struct tree_node *root);
+
 #endif /* TREE_H */
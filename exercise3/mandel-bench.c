@@ -0,0 +1,260 @@
+/*
+ * mandel-bench.c
+ *
+ * Times the Mandelbrot kernels of mandel-lib.c over a view, by default
+ * the one of mandel.c, which is mostly inside the set:
+ *   brute-force: mandel_iterations_brute_force(), every iteration up to max
+ *   scalar:      mandel_iterations_at_point(), with the interior shortcuts
+ *   vector:      mandel_iterations_at_points(), the same with SIMD
+ *   mariani-silver: fb_ms_step() of mandel-fb.c, which only computes
+ *                the borders of rectangles, and fills in the uniform ones
+ * and checks that they all give the same iteration counts.
+ *
+ * It also reports what outputting the frame to an xterm costs, with an
+ * escape and a write() per point, as the programs used to, and encoded
+ * with run-length color escapes and written with a single writev().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "mandel-lib.h"
+#include "mandel-fb.h"
+
+/*
+ * The part of the complex plane to be drawn, set by main():
+ * upper left corner is (xmin, ymax), lower right corner is (xmax, ymin)
+ */
+double xmin, xmax;
+double ymin, ymax;
+
+enum kernel {
+	K_BRUTE_FORCE,
+	K_SCALAR,
+	K_VECTOR,
+	K_MARIANI_SILVER,
+	NR_KERNELS
+};
+
+static const char *kernel_names[NR_KERNELS] = {
+	[K_BRUTE_FORCE] = "brute-force",
+	[K_SCALAR] = "scalar",
+	[K_VECTOR] = "vector",
+	[K_MARIANI_SILVER] = "mariani-silver",
+};
+
+void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-W WIDTH] [-H HEIGHT] [-R XMIN,XMAX,YMIN,YMAX]\n"
+			"          [-I MAX_ITERATION] [-F FILE]\n\n"
+			"    Renders the view with every kernel, and prints the time each took.\n"
+			"    -w, -h and -m are the same as -W, -H and -I.\n"
+			MANDEL_VIEW_USAGE,
+			argv0);
+	exit(1);
+}
+
+double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * renders the frame with Mariani-Silver, on one thread, into iter[],
+ * with the counts saturated as in the framebuffer
+ */
+long render_mariani_silver(int width, int height, int max, int *iter)
+{
+	struct framebuffer *fb;
+	struct tile *stack, t, child[2];
+	int n = 0, size = 64, i, k;
+	size_t p;
+	long points;
+
+	fb = fb_create(width, height, xmin, xmax, ymin, ymax);
+	stack = malloc(size * sizeof(*stack));
+	if (fb == NULL || stack == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		exit(1);
+	}
+
+	points = fb_ms_begin(fb, &stack[n++], max);
+	while (n > 0) {
+		t = stack[--n];
+		k = fb_ms_step(fb, &t, max, child, &points);
+		if (n + k > size) {
+			size *= 2;
+			stack = realloc(stack, size * sizeof(*stack));
+			if (stack == NULL) {
+				fprintf(stderr, "allocation failed\n");
+				exit(1);
+			}
+		}
+		for (i = 0; i < k; i++)
+			stack[n++] = child[i];
+	}
+
+	for (p = 0; p < (size_t)width * height; p++)
+		iter[p] = fb->iter[p];
+	free(stack);
+	fb_destroy(fb);
+	return points;
+}
+
+/*
+ * renders the frame into iter[], the points as the mandel programs step them,
+ * and returns the number of points computed
+ */
+long render(enum kernel k, int width, int height, int max, int *iter)
+{
+	double xstep = (xmax - xmin) / width, ystep = (ymax - ymin) / height;
+	double x, y, *xs, *ys;
+	int line, n, *row;
+
+	if (k == K_MARIANI_SILVER)
+		return render_mariani_silver(width, height, max, iter);
+
+	/* on the heap, a line of a view can be VIEW_MAX_SIZE points */
+	xs = malloc(width * sizeof(*xs));
+	ys = malloc(width * sizeof(*ys));
+	if (xs == NULL || ys == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		exit(1);
+	}
+
+	for (line = 0; line < height; line++) {
+		row = &iter[(size_t)line * width];
+		y = ymax - ystep * line;
+		for (x = xmin, n = 0; n < width; x += xstep, n++) {
+			xs[n] = x;
+			ys[n] = y;
+		}
+
+		switch (k) {
+		case K_BRUTE_FORCE:
+			for (n = 0; n < width; n++)
+				row[n] = mandel_iterations_brute_force(xs[n], ys[n], max);
+			break;
+		case K_SCALAR:
+			for (n = 0; n < width; n++)
+				row[n] = mandel_iterations_at_point(xs[n], ys[n], max);
+			break;
+		default:
+			mandel_iterations_at_points(xs, ys, row, width, max);
+			break;
+		}
+	}
+	free(xs);
+	free(ys);
+	return (long)width * height;
+}
+
+/* the bytes and system calls of a frame, per point and run-length encoded */
+void report_output(int width, int height, int *iter)
+{
+	char *buf, escape[XTERM_ESCAPE_SIZE + 1];
+	int *color_val, *row, line, n, color = -1;
+	size_t per_point = 0, encoded = 0;
+
+	buf = malloc(XTERM_LINE_SIZE((size_t)width));
+	color_val = malloc(width * sizeof(*color_val));
+	if (buf == NULL || color_val == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		exit(1);
+	}
+
+	for (line = 0; line < height; line++) {
+		row = &iter[(size_t)line * width];
+		for (n = 0; n < width; n++) {
+			color_val[n] = xterm_color(row[n] > 255 ? 255 : row[n]);
+			per_point += snprintf(escape, sizeof(escape), "\033[38;5;%dm",
+				color_val[n]) + 1;
+		}
+		per_point++;
+		encoded += xterm_encode_line(buf, color_val, width, &color);
+	}
+
+	/* every point: an escape and a write(), every line a newline, then the reset */
+	printf("output per frame: %zu bytes in %zu write() calls per point, "
+		"%zu bytes in 1 writev() run-length encoded\n",
+		per_point + 4, 2 * (size_t)width * height + height + 1, encoded + 4);
+	free(buf);
+	free(color_val);
+}
+
+int main(int argc, char *argv[])
+{
+	struct mandel_view view = MANDEL_VIEW_DEFAULT;
+	int opt, ret, width, height, max;
+	int *iter[NR_KERNELS], k, brute;
+	size_t i, nr_points, mismatches, interior;
+	double start, ms[NR_KERNELS];
+	long points;
+
+	while ((opt = getopt(argc, argv, "w:h:m:" MANDEL_VIEW_OPTIONS)) != -1) {
+		/* the options this program had before there were views */
+		if (opt == 'w')
+			opt = 'W';
+		else if (opt == 'h')
+			opt = 'H';
+		else if (opt == 'm')
+			opt = 'I';
+		ret = mandel_view_option(&view, opt, optarg);
+		if (ret < 0)
+			exit(1);
+		if (ret > 0)
+			usage(argv[0]);
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	width = view.width;
+	height = view.height;
+	max = view.max_iteration;
+	xmin = view.xmin;
+	xmax = view.xmax;
+	ymin = view.ymin;
+	ymax = view.ymax;
+
+	nr_points = (size_t)width * height;
+	printf("%d x %d points of [%g, %g] x [%g, %g], max %d iterations, vector kernel: %s\n",
+		width, height, xmin, xmax, ymin, ymax, max, mandel_kernel_name());
+	for (k = 0; k < NR_KERNELS; k++) {
+		iter[k] = malloc(nr_points * sizeof(int));
+		if (iter[k] == NULL) {
+			fprintf(stderr, "allocation failed\n");
+			exit(1);
+		}
+
+		start = now_ms();
+		points = render(k, width, height, max, iter[k]);
+		ms[k] = now_ms() - start;
+
+		mismatches = 0;
+		for (i = 0; i < nr_points; i++) {
+			brute = iter[K_BRUTE_FORCE][i];
+			if (k == K_MARIANI_SILVER && brute > FB_ITER_MAX)
+				brute = FB_ITER_MAX;
+			mismatches += iter[k][i] != brute;
+		}
+		printf("%-14s %10.3f ms %8.2fx  %zu mismatches, %.1f%% of the points computed\n",
+			kernel_names[k], ms[k], ms[K_BRUTE_FORCE] / ms[k], mismatches,
+			100.0 * points / nr_points);
+	}
+
+	interior = 0;
+	for (i = 0; i < nr_points; i++)
+		interior += iter[K_BRUTE_FORCE][i] == max;
+	printf("%.1f%% of the points are inside the set\n", 100.0 * interior / nr_points);
+
+	report_output(width, height, iter[K_VECTOR]);
+
+	for (k = 0; k < NR_KERNELS; k++)
+		free(iter[k]);
+	return 0;
+}
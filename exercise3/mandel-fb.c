@@ -0,0 +1,293 @@
+/*
+ * mandel-fb.c
+ *
+ * A framebuffer holding a whole frame of iteration counts,
+ * and a scheduler handing it out to threads in square tiles.
+ *
+ * Computing, coloring and output are separate passes over the frame:
+ * threads fill in tiles of 16-bit counts, then the frame is turned into
+ * color values and encoded for the xterm, a line at a time. A 16 x 16
+ * tile of counts is 512 bytes, and its points are close together on the
+ * plane, so they take about as long as each other and fit in the cache.
+ *
+ * The frame can also be rendered with the Mariani-Silver algorithm, which
+ * computes only the border of a rectangle and, if every point on it has
+ * the same count, fills the inside with it. The set of points with at
+ * least a given count is connected and has no holes, so the inside of
+ * such a border cannot hold any other count. Otherwise the rectangle is
+ * cut in two, through its middle, and both halves are done the same way.
+ * That holds for the plane, not for a frame sampled at points, though: a
+ * filament of another count thinner than a point can slip between those
+ * of a border and be filled over, so the result is approximate.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#include "mandel-lib.h"
+#include "mandel-fb.h"
+
+/* rectangles this small or smaller are computed rather than cut in two */
+#define MS_MIN_SIZE	6
+
+/*
+ * Allocates a width x height frame of the part of the complex plane with
+ * upper left corner (xmin, ymax) and lower right corner (xmax, ymin).
+ * The coordinates of the points are worked out once, here, exactly as
+ * compute_mandel_line() steps through them, so that any tile of the frame
+ * gets the same counts as the line by line programs.
+ */
+struct framebuffer *fb_create(int width, int height,
+	double xmin, double xmax, double ymin, double ymax)
+{
+	struct framebuffer *fb;
+	double x, xstep, ystep;
+	int n;
+
+	fb = malloc(sizeof(*fb));
+	if (fb == NULL)
+		return NULL;
+	fb->width = width;
+	fb->height = height;
+	fb->x = malloc(width * sizeof(double));
+	fb->y = malloc(height * sizeof(double));
+	fb->iter = malloc((size_t)width * height * sizeof(uint16_t));
+	if (fb->x == NULL || fb->y == NULL || fb->iter == NULL) {
+		fb_destroy(fb);
+		return NULL;
+	}
+
+	xstep = (xmax - xmin) / width;
+	ystep = (ymax - ymin) / height;
+	for (x = xmin, n = 0; n < width; x += xstep, n++)
+		fb->x[n] = x;
+	for (n = 0; n < height; n++)
+		fb->y[n] = ymax - ystep * n;
+
+	return fb;
+}
+
+void fb_destroy(struct framebuffer *fb)
+{
+	free(fb->x);
+	free(fb->y);
+	free(fb->iter);
+	free(fb);
+}
+
+/*
+ * Computes the counts of the points of a tile, a row at a time
+ * with the vector kernel, and stores them in the frame.
+ */
+void fb_render_tile(struct framebuffer *fb, const struct tile *t, int max)
+{
+	double ys[t->w];
+	int iter[t->w];
+	uint16_t *row;
+	int line, n;
+
+	for (line = t->y0; line < t->y0 + t->h; line++) {
+		for (n = 0; n < t->w; n++)
+			ys[n] = fb->y[line];
+		mandel_iterations_at_points(&fb->x[t->x0], ys, iter, t->w, max);
+
+		row = &fb->iter[(size_t)line * fb->width + t->x0];
+		for (n = 0; n < t->w; n++)
+			row[n] = iter[n] < FB_ITER_MAX ? iter[n] : FB_ITER_MAX;
+	}
+}
+
+/*
+ * Computes the n points of a column, from line y0 down.
+ */
+static void render_column(struct framebuffer *fb, int x, int y0, int n, int max)
+{
+	double xs[n];
+	int iter[n];
+	int i;
+
+	if (n <= 0)
+		return;
+	for (i = 0; i < n; i++)
+		xs[i] = fb->x[x];
+	mandel_iterations_at_points(xs, &fb->y[y0], iter, n, max);
+
+	for (i = 0; i < n; i++)
+		fb->iter[(size_t)(y0 + i) * fb->width + x] =
+			iter[i] < FB_ITER_MAX ? iter[i] : FB_ITER_MAX;
+}
+
+/*
+ * Starts a Mariani-Silver rendering of the frame: computes its border and
+ * stores the whole frame in *t, for fb_ms_step(). Returns the number of
+ * points computed.
+ */
+long fb_ms_begin(struct framebuffer *fb, struct tile *t, int max)
+{
+	struct tile row = { 0, 0, fb->width, 1 };
+
+	t->x0 = t->y0 = 0;
+	t->w = fb->width;
+	t->h = fb->height;
+
+	fb_render_tile(fb, &row, max);
+	if (t->h == 1)
+		return t->w;
+	row.y0 = t->h - 1;
+	fb_render_tile(fb, &row, max);
+	if (t->h == 2)
+		return 2 * t->w;
+
+	render_column(fb, 0, 1, t->h - 2, max);
+	if (t->w > 1)
+		render_column(fb, t->w - 1, 1, t->h - 2, max);
+	return 2 * t->w + (t->w > 1 ? 2 : 1) * (t->h - 2);
+}
+
+/* Is every point on the border of t the same count? */
+static int border_uniform(const struct framebuffer *fb, const struct tile *t)
+{
+	const uint16_t *top = &fb->iter[(size_t)t->y0 * fb->width + t->x0];
+	const uint16_t *bottom = top + (size_t)(t->h - 1) * fb->width;
+	uint16_t v = top[0];
+	int i;
+
+	for (i = 0; i < t->w; i++)
+		if (top[i] != v || bottom[i] != v)
+			return 0;
+	for (i = 1; i < t->h - 1; i++)
+		if (top[(size_t)i * fb->width] != v || top[(size_t)i * fb->width + t->w - 1] != v)
+			return 0;
+	return 1;
+}
+
+/*
+ * Does a rectangle whose border has been computed: fills its inside, or
+ * computes it if it is small, or cuts it in two through the middle of its
+ * longer side, computing the line between the halves. The halves, if any,
+ * go in child[] and their number is returned. Rectangles only share
+ * borders, which are never written again, so different threads can do
+ * different rectangles. *points is increased by the points computed.
+ */
+int fb_ms_step(struct framebuffer *fb, const struct tile *t, int max,
+	struct tile child[2], long *points)
+{
+	struct tile inside = { t->x0 + 1, t->y0 + 1, t->w - 2, t->h - 2 };
+	uint16_t v, *row;
+	int line, n, mid;
+
+	if (inside.w <= 0 || inside.h <= 0)
+		return 0;
+
+	if (border_uniform(fb, t)) {
+		v = fb->iter[(size_t)t->y0 * fb->width + t->x0];
+		for (line = inside.y0; line < inside.y0 + inside.h; line++) {
+			row = &fb->iter[(size_t)line * fb->width + inside.x0];
+			for (n = 0; n < inside.w; n++)
+				row[n] = v;
+		}
+		return 0;
+	}
+
+	if (t->w <= MS_MIN_SIZE && t->h <= MS_MIN_SIZE) {
+		fb_render_tile(fb, &inside, max);
+		*points += inside.w * inside.h;
+		return 0;
+	}
+
+	child[0] = child[1] = *t;
+	if (t->w >= t->h) {
+		mid = t->x0 + t->w / 2;
+		render_column(fb, mid, inside.y0, inside.h, max);
+		*points += inside.h;
+		child[0].w = mid - t->x0 + 1;
+		child[1].x0 = mid;
+		child[1].w = t->x0 + t->w - mid;
+	} else {
+		mid = t->y0 + t->h / 2;
+		inside.y0 = mid;
+		inside.h = 1;
+		fb_render_tile(fb, &inside, max);
+		*points += inside.w;
+		child[0].h = mid - t->y0 + 1;
+		child[1].y0 = mid;
+		child[1].h = t->y0 + t->h - mid;
+	}
+	return 2;
+}
+
+/*
+ * The coloring pass, for a line: turns its counts
+ * into the color values of the xterm palette.
+ */
+void fb_color_line(const struct framebuffer *fb, int line, int color_val[])
+{
+	const uint16_t *row = &fb->iter[(size_t)line * fb->width];
+	int n;
+
+	for (n = 0; n < fb->width; n++)
+		color_val[n] = xterm_color(row[n]);
+}
+
+/*
+ * The output pass: colors and encodes the frame a line at a time, then
+ * outputs it and resets the colors with a single writev(). Returns the
+ * number of writev() calls, or -1 on error.
+ */
+int fb_write_xterm(const struct framebuffer *fb, int fd)
+{
+	struct iovec *iov;
+	int color_val[fb->width];
+	int line, color = -1, ret;
+	char *text;
+
+	iov = malloc((fb->height + 1) * sizeof(*iov));
+	text = malloc((size_t)fb->height * XTERM_LINE_SIZE(fb->width));
+	if (iov == NULL || text == NULL) {
+		fprintf(stderr, "fb_write_xterm: allocation failed\n");
+		exit(1);
+	}
+
+	for (line = 0; line < fb->height; line++) {
+		fb_color_line(fb, line, color_val);
+		iov[line].iov_base = text + (size_t)line * XTERM_LINE_SIZE(fb->width);
+		iov[line].iov_len = xterm_encode_line(iov[line].iov_base, color_val,
+			fb->width, &color);
+	}
+	iov[fb->height].iov_base = "\033[0m";
+	iov[fb->height].iov_len = 4;
+
+	ret = insist_writev(fd, iov, fb->height + 1);
+	free(iov);
+	free(text);
+	return ret;
+}
+
+void tile_sched_init(struct tile_sched *ts, const struct framebuffer *fb, int size)
+{
+	ts->size = size;
+	ts->tiles_x = (fb->width + size - 1) / size;
+	ts->tiles_y = (fb->height + size - 1) / size;
+	ts->next = 0;
+}
+
+/*
+ * Claims the next tile of the frame for the calling thread.
+ * Returns 0 when every tile has been claimed.
+ */
+int tile_claim(struct tile_sched *ts, const struct framebuffer *fb, struct tile *t)
+{
+	int k;
+
+	k = __sync_fetch_and_add(&ts->next, 1);
+	if (k >= ts->tiles_x * ts->tiles_y)
+		return 0;
+
+	t->x0 = k % ts->tiles_x * ts->size;
+	t->y0 = k / ts->tiles_x * ts->size;
+	t->w = t->x0 + ts->size < fb->width ? ts->size : fb->width - t->x0;
+	t->h = t->y0 + ts->size < fb->height ? ts->size : fb->height - t->y0;
+	return 1;
+}
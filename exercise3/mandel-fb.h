@@ -0,0 +1,52 @@
+/*
+ * mandel-fb.h
+ *
+ * A framebuffer holding a whole frame of iteration counts,
+ * and a scheduler handing it out to threads in square tiles.
+ *
+ */
+
+#ifndef MANDEL_FB_H__
+#define MANDEL_FB_H__
+
+#include <stdint.h>
+
+/*
+ * Counts are stored saturated at FB_ITER_MAX. Only counts up to 255
+ * get colors of their own, so no frame is drawn differently.
+ */
+#define FB_ITER_MAX	UINT16_MAX
+
+struct framebuffer {
+	int width, height;
+	double *x;		/* the x of every column, as the mandel programs step them */
+	double *y;		/* the y of every line */
+	uint16_t *iter;		/* height lines of width counts, one after the other */
+};
+
+/* A rectangle of the frame, w x h points with its upper left corner at (x0, y0) */
+struct tile {
+	int x0, y0;
+	int w, h;
+};
+
+struct tile_sched {
+	int size;		/* tiles are size x size, less on the right and bottom edges */
+	int tiles_x, tiles_y;
+	int next;		/* the next tile to be claimed, row by row */
+};
+
+/* Function prototypes */
+struct framebuffer *fb_create(int width, int height,
+	double xmin, double xmax, double ymin, double ymax);
+void fb_destroy(struct framebuffer *fb);
+void fb_render_tile(struct framebuffer *fb, const struct tile *t, int max);
+void fb_color_line(const struct framebuffer *fb, int line, int color_val[]);
+long fb_ms_begin(struct framebuffer *fb, struct tile *t, int max);
+int fb_ms_step(struct framebuffer *fb, const struct tile *t, int max,
+	struct tile child[2], long *points);
+int fb_write_xterm(const struct framebuffer *fb, int fd);
+void tile_sched_init(struct tile_sched *ts, const struct framebuffer *fb, int size);
+int tile_claim(struct tile_sched *ts, const struct framebuffer *fb, struct tile *t);
+
+#endif /* MANDEL_FB_H__ */
@@ -0,0 +1,289 @@
+/*
+ * mandel-fork.c
+ *
+ * A program to draw the Mandelbrot Set on a 256-color xterm, using multiple processes.
+ *
+ * The frame lives in a MAP_SHARED mapping, created before forking NPROCS
+ * workers. Workers claim lines from a shared atomic counter, store their
+ * color values in the frame and mark the line done. The parent draws the
+ * frame once every worker has exited; lines claimed by a worker that
+ * crashed are not marked done, and the parent computes them itself.
+ *
+ * The view, its size and the iteration cap can be given on the command
+ * line or in a file; see MANDEL_VIEW_USAGE in mandel-lib.h.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "mandel-lib.h"
+
+/***********************************************
+ * Run-time parameters, set by main() from the *
+ * command line, MANDEL_VIEW_DEFAULT otherwise *
+ ***********************************************/
+
+/*
+ * Output at the terminal is is x_chars wide by y_chars long
+*/
+int y_chars;
+int x_chars;
+
+/*
+ * The part of the complex plane to be drawn:
+ * upper left corner is (xmin, ymax), lower right corner is (xmax, ymin)
+*/
+double xmin, xmax;
+double ymin, ymax;
+
+/* Iterations before a point counts as inside the set */
+int max_iteration;
+
+/*
+ * Every character in the final output is
+ * xstep x ystep units wide on the complex plane.
+ */
+double xstep;
+double ystep;
+
+int NPROCS;
+
+/*
+ * Shared between the parent and the workers.
+ */
+struct frame {
+	int next_line;		/* the next line to be claimed */
+	int *done;		/* y_chars flags, set once a line is in color_val */
+	int *color_val;		/* y_chars lines of x_chars color values */
+};
+
+struct frame *frame;
+
+/*
+ * Function for usage of the executable from pthread-test.c
+ */
+void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-W WIDTH] [-H HEIGHT] [-R XMIN,XMAX,YMIN,YMAX]\n"
+			"          [-I MAX_ITERATION] [-F FILE] NPROCS\n\n"
+			"    NPROCS: The number of worker processes to create.\n"
+			MANDEL_VIEW_USAGE,
+			argv0);
+	exit(1);
+}
+
+/*
+ * Function for safe atoi from pthread-test.c
+ */
+int safe_atoi(char *s, int *val)
+{
+	long l;
+	char *endp;
+
+	l = strtol(s, &endp, 10);
+	if (s != endp && *endp == '\0') {
+		*val = l;
+		return 0;
+	} else
+		return -1;
+}
+
+/*
+ * Create a shared memory area, usable by all descendants of the calling process,
+ * as create_shared_memory_area() in exercise2/proc-common.c does.
+ */
+void *create_shared_memory_area(size_t numbytes)
+{
+	size_t pages;
+	void *addr;
+
+	if (numbytes == 0) {
+		fprintf(stderr, "%s: internal error: called for numbytes == 0\n", __func__);
+		exit(1);
+	}
+
+	/* Determine the number of pages needed, round up the requested number of pages */
+	pages = (numbytes - 1) / sysconf(_SC_PAGE_SIZE) + 1;
+
+	/* Create a shared, anonymous mapping for this number of pages */
+	addr = mmap(NULL, pages * sysconf(_SC_PAGE_SIZE),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("create_shared_memory_area: mmap failed");
+		exit(1);
+	}
+
+	return addr;
+}
+
+/*
+ * This function computes a line of output
+ * as an array of x_char color values.
+ */
+void compute_mandel_line(int line, int color_val[])
+{
+	/*
+	 * x and y traverse the complex plane.
+	 */
+	double x, y;
+	double xs[x_chars], ys[x_chars];
+
+	int n;
+	int val;
+
+	/* Find out the y value corresponding to this line */
+	y = ymax - ystep * line;
+
+	/* collect the points on this line, then iterate for all of them at once */
+	for (x = xmin, n = 0; n < x_chars; x+= xstep, n++) {
+		xs[n] = x;
+		ys[n] = y;
+	}
+	mandel_iterations_at_points(xs, ys, color_val, x_chars, max_iteration);
+
+	for (n = 0; n < x_chars; n++) {
+		/* Turn the point's iterations into a color value */
+		val = color_val[n];
+		if (val > 255)
+			val = 255;
+
+		/* And store it in the color_val[] array */
+		color_val[n] = xterm_color(val);
+	}
+}
+
+/* Claims lines until there are none left. */
+void worker(void)
+{
+	int line;
+
+	while ((line = __sync_fetch_and_add(&frame->next_line, 1)) < y_chars) {
+		compute_mandel_line(line, &frame->color_val[(size_t)line * x_chars]);
+		/* the line must be complete before it is marked done */
+		__sync_synchronize();
+		frame->done[line] = 1;
+	}
+	exit(0);
+}
+
+double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	struct mandel_view view = MANDEL_VIEW_DEFAULT;
+	int i, status, line, failed = 0, color = -1, opt, ret;
+	struct iovec *iov;
+	double start;
+	char *shm, *text;
+	pid_t p;
+
+	while ((opt = getopt(argc, argv, MANDEL_VIEW_OPTIONS)) != -1) {
+		ret = mandel_view_option(&view, opt, optarg);
+		if (ret < 0)
+			exit(1);
+		if (ret > 0)
+			usage(argv[0]);
+	}
+	if (argc - optind != 1)
+		usage(argv[0]);
+
+	if (safe_atoi(argv[optind], &NPROCS) < 0 || NPROCS <= 0) {
+		fprintf(stderr, "`%s' is not valid for `NPROCS'\n", argv[optind]);
+		exit(1);
+	}
+
+	x_chars = view.width;
+	y_chars = view.height;
+	xmin = view.xmin;
+	xmax = view.xmax;
+	ymin = view.ymin;
+	ymax = view.ymax;
+	max_iteration = view.max_iteration;
+
+	xstep = (xmax - xmin) / x_chars;
+	ystep = (ymax - ymin) / y_chars;
+
+	/* The frame header, the done flags and the color values, in one mapping */
+	shm = create_shared_memory_area(sizeof(*frame) +
+		y_chars * sizeof(int) + (size_t)y_chars * x_chars * sizeof(int));
+	frame = (struct frame *)shm;
+	frame->done = (int *)(shm + sizeof(*frame));
+	frame->color_val = frame->done + y_chars;
+
+	start = now_ms();
+	for (i = 0; i < NPROCS; i++) {
+		p = fork();
+		if (p < 0) {
+			perror("fork");
+			exit(1);
+		}
+		if (p == 0)
+			worker();
+	}
+
+	/* Wait for all workers; a crash only costs the lines it had claimed */
+	for (i = 0; i < NPROCS; i++) {
+		p = wait(&status);
+		if (p < 0) {
+			perror("wait");
+			exit(1);
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			if (WIFSIGNALED(status))
+				fprintf(stderr, "worker %ld was killed by signal %d\n",
+					(long)p, WTERMSIG(status));
+			else
+				fprintf(stderr, "worker %ld exited with status %d\n",
+					(long)p, WEXITSTATUS(status));
+			failed++;
+		}
+	}
+	if (failed)
+		for (line = 0; line < y_chars; line++)
+			if (!frame->done[line]) {
+				fprintf(stderr, "recomputing line %d\n", line);
+				compute_mandel_line(line, &frame->color_val[(size_t)line * x_chars]);
+			}
+
+	/*
+	 * Encode the frame, with a color escape only where the color changes,
+	 * and output it and reset the colors with a single writev().
+	 * Output is sent to file descriptor '1', i.e., standard output.
+	 */
+	text = malloc((size_t)y_chars * XTERM_LINE_SIZE(x_chars));
+	iov = malloc((y_chars + 1) * sizeof(*iov));
+	if (text == NULL || iov == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		exit(1);
+	}
+	for (line = 0; line < y_chars; line++) {
+		iov[line].iov_base = text + (size_t)line * XTERM_LINE_SIZE(x_chars);
+		iov[line].iov_len = xterm_encode_line(iov[line].iov_base,
+			&frame->color_val[(size_t)line * x_chars], x_chars, &color);
+	}
+	iov[y_chars].iov_base = "\033[0m";
+	iov[y_chars].iov_len = 4;
+	if (insist_writev(1, iov, y_chars + 1) < 0) {
+		perror("main: insist_writev");
+		exit(1);
+	}
+	free(text);
+	free(iov);
+	fprintf(stderr, "%d processes: frame rendered in %.3f ms\n", NPROCS, now_ms() - start);
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * mandel-image.c
+ *
+ * Binary PPM and PGM images of the Mandelbrot Set,
+ * stored in place through a shared mapping of the file.
+ *
+ * The file is created at its final size, with its blocks allocated, and
+ * mapped MAP_SHARED, so that every thread stores the pixels it computed
+ * at their final offsets: there is no writer to hand them to, and no
+ * write() at all, the kernel writes the dirty pages back by itself.
+ * Allocating the blocks up front means a full disk is an error here,
+ * rather than a SIGBUS in a thread halfway through the frame.
+ *
+ * PPM pixels are the palette's colors, as on the xterm but not rounded to
+ * its 256 colors; PGM pixels are the color values themselves, the counts
+ * up to 255, as gray levels.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "mandel-lib.h"
+#include "mandel-image.h"
+
+#define IMAGE_HEADER_SIZE	64
+
+/*
+ * Creates filename, a width x height PPM or PGM image, according to its
+ * extension, and maps it. Returns NULL, having said why, on error.
+ */
+struct image *image_create(const char *filename, int width, int height)
+{
+	char header[IMAGE_HEADER_SIZE];
+	const char *ext = strrchr(filename, '.');
+	struct image *img;
+	int fd, ret, len;
+
+	img = malloc(sizeof(*img));
+	if (img == NULL) {
+		fprintf(stderr, "image_create: allocation failed\n");
+		return NULL;
+	}
+
+	if (ext != NULL && strcmp(ext, ".ppm") == 0)
+		img->channels = 3;
+	else if (ext != NULL && strcmp(ext, ".pgm") == 0)
+		img->channels = 1;
+	else {
+		fprintf(stderr, "%s: not a .ppm or a .pgm file\n", filename);
+		free(img);
+		return NULL;
+	}
+
+	img->width = width;
+	img->height = height;
+	img->rgb = mandel_palette_rgb();
+	len = snprintf(header, sizeof(header), "P%d\n%d %d\n255\n",
+		img->channels == 3 ? 6 : 5, width, height);
+	img->size = len + (size_t)width * height * img->channels;
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(filename);
+		free(img);
+		return NULL;
+	}
+	/* posix_fallocate() returns the error number, instead of setting errno */
+	ret = posix_fallocate(fd, 0, img->size);
+	if (ret) {
+		errno = ret;
+		perror(filename);
+		close(fd);
+		free(img);
+		return NULL;
+	}
+
+	img->map = mmap(NULL, img->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (img->map == MAP_FAILED) {
+		perror("image_create: mmap");
+		free(img);
+		return NULL;
+	}
+
+	memcpy(img->map, header, len);
+	img->pixels = img->map + len;
+	return img;
+}
+
+/* Stores n pixels of line, from column x0, with the given counts */
+static void store_pixels(struct image *img, int line, int x0, const int iter[],
+	const uint16_t iter16[], int n)
+{
+	unsigned char *p = img->pixels + ((size_t)line * img->width + x0) * img->channels;
+	int i, val;
+
+	for (i = 0; i < n; i++) {
+		val = iter != NULL ? iter[i] : iter16[i];
+		if (val > 255)
+			val = 255;
+
+		if (img->channels == 1)
+			*p++ = val;
+		else {
+			memcpy(p, &img->rgb[3 * val], 3);
+			p += 3;
+		}
+	}
+}
+
+/* Stores a whole line of the image, from the counts of its points */
+void image_store_line(struct image *img, int line, const int iter[])
+{
+	store_pixels(img, line, 0, iter, NULL, img->width);
+}
+
+/* Stores the tile t of the image, from the counts in fb */
+void image_store_tile(struct image *img, const struct framebuffer *fb, const struct tile *t)
+{
+	int line;
+
+	for (line = t->y0; line < t->y0 + t->h; line++)
+		store_pixels(img, line, t->x0, NULL,
+			&fb->iter[(size_t)line * fb->width + t->x0], t->w);
+}
+
+/*
+ * Unmaps the image. The pixels are in the page cache already, and
+ * reach the disk with the rest of the dirty pages.
+ */
+int image_close(struct image *img)
+{
+	int ret;
+
+	ret = munmap(img->map, img->size);
+	free(img);
+	return ret;
+}
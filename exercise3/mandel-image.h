@@ -0,0 +1,31 @@
+/*
+ * mandel-image.h
+ *
+ * Binary PPM and PGM images of the Mandelbrot Set,
+ * stored in place through a shared mapping of the file.
+ *
+ */
+
+#ifndef MANDEL_IMAGE_H__
+#define MANDEL_IMAGE_H__
+
+#include <stddef.h>
+
+#include "mandel-fb.h"
+
+struct image {
+	int width, height;
+	int channels;			/* 3 for PPM, red, green and blue; 1 for PGM, gray */
+	unsigned char *pixels;		/* the first pixel, after the header */
+	unsigned char *map;		/* the whole file */
+	size_t size;
+	const unsigned char *rgb;	/* the palette, for PPM */
+};
+
+/* Function prototypes */
+struct image *image_create(const char *filename, int width, int height);
+void image_store_line(struct image *img, int line, const int iter[]);
+void image_store_tile(struct image *img, const struct framebuffer *fb, const struct tile *t);
+int image_close(struct image *img);
+
+#endif /* MANDEL_IMAGE_H__ */
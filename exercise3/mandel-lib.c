@@ -12,9 +12,17 @@
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include "mandel-lib.h"
 
+/* only defined by limits.h with _XOPEN_SOURCE, 1024 on Linux */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 /*****************************************
  *                                       *
  * Functions to manage a 256-color xterm *
@@ -91,6 +99,7 @@ static void maketable()
 		colortable[c][1] = rgb[1];
 		colortable[c][2] = rgb[2];
 	}
+	initialized = 1;
 }
 
 // selects the nearest xterm color for a 3xBYTE rgb value
@@ -396,8 +405,11 @@ static struct { double red; double green; double blue; } mandel256[] = {
  * This function takes a (x,y) point on the complex plane
  * and uses the escape time algorithm to return a color value
  * used to draw the Mandelbrot Set.
+ *
+ * It runs every iteration, up to max for the points inside the set;
+ * mandel_iterations_at_point() returns the same, faster.
  */
-int mandel_iterations_at_point(double x, double y, int max)
+int mandel_iterations_brute_force(double x, double y, int max)
 {
 	double x0 = x;
 	double y0 = y;
@@ -416,6 +428,609 @@ int mandel_iterations_at_point(double x, double y, int max)
 	return iter;
 }
 
+/*
+ * Points that are well inside the main cardioid or the period-2 bulb
+ * never escape, so the answer is max without iterating. Points within
+ * INTERIOR_MARGIN of their boundary are left to the loop, where the
+ * rounding of the test itself could make a difference.
+ */
+#define INTERIOR_MARGIN	1e-6
+
+static int in_cardioid_or_bulb(double x, double y)
+{
+	double q, y2 = y * y;
+
+	/* the bulb is the disc of radius 1/4 around -1 */
+	if ((x + 1) * (x + 1) + y2 < 0.0625 - INTERIOR_MARGIN)
+		return 1;
+
+	q = (x - 0.25) * (x - 0.25) + y2;
+	return q * (q + (x - 0.25)) < 0.25 * y2 - INTERIOR_MARGIN;
+}
+
+/*
+ * Periodicity checking: the orbit is saved at iterations 8, 16, 32, ...
+ * and compared with every later point. If it comes back to a saved point
+ * exactly, the (deterministic) loop would go round the same cycle until
+ * max without escaping, so the answer is max. Interior points outside
+ * the cardioid and the bulb fall into such a cycle, in floating point,
+ * long before max.
+ */
+#define PERIOD_FIRST_CHECK	8
+
+/*
+ * Up to this many iterations, checking costs more than the few interior
+ * points outside the cardioid and the bulb take to reach max anyway. The
+ * kernels for such caps are compiled without it.
+ */
+#define PERIOD_MIN_MAX		256
+
+/*
+ * The kernels below are inlined into a copy for every iteration cap in
+ * MANDEL_CAPS, where max is a constant and the tests on it are compiled
+ * away, as well as into one for any max.
+ */
+#define KERNEL_BODY	static inline __attribute__((always_inline))
+
+/*
+ * This function takes a (x,y) point on the complex plane
+ * and returns exactly what mandel_iterations_brute_force() does,
+ * stopping early for the points that are known to be inside the set.
+ */
+KERNEL_BODY int iterations_at_point(double x, double y, int max)
+{
+	double x0 = x;
+	double y0 = y;
+	double xs = x, ys = y;
+	int iter = 0, check = PERIOD_FIRST_CHECK;
+
+	if (in_cardioid_or_bulb(x0, y0))
+		return max;
+
+	while ( (x * x + y * y <= 4) && iter < max) {
+		double xt = x * x - y * y + x0;
+		double yt = 2 * x * y + y0;
+
+		x = xt;
+		y = yt;
+
+		++iter;
+
+		if (max <= PERIOD_MIN_MAX)
+			continue;
+		if (x == xs && y == ys)
+			return max;
+		if (iter == check) {
+			xs = x;
+			ys = y;
+			check *= 2;
+		}
+	}
+
+	return iter;
+}
+
+int mandel_iterations_at_point(double x, double y, int max)
+{
+	return iterations_at_point(x, y, max);
+}
+
+/*
+ * Vectorized versions of mandel_iterations_at_point(), for 4 (AVX2) or
+ * 8 (AVX-512) points at a time. The points that have escaped are masked
+ * out: their x, y and iteration count stay as they were, and the loop
+ * ends when no point is left or max is reached. They take the same
+ * shortcuts for interior points as mandel_iterations_at_point().
+ *
+ * Every operation is the same, in the same order, as in the scalar
+ * loop, and they must not be contracted into fused multiply-adds (which
+ * round once instead of twice), so that the results match it exactly.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define MANDEL_VECTOR_KERNELS 1
+
+#define AVX2_KERNEL	__attribute__((target("avx2"), optimize("fp-contract=off")))
+#define AVX512_KERNEL	__attribute__((target("avx512f"), optimize("fp-contract=off")))
+
+AVX2_KERNEL KERNEL_BODY void mandel_iterations_avx2(const double *px, const double *py, int *iter, int max)
+{
+	__m256d x0 = _mm256_loadu_pd(px), y0 = _mm256_loadu_pd(py);
+	__m256d x = x0, y = y0, xs = x0, ys = y0, xx, yy, xt, yt, alive, cycled;
+	__m256d four = _mm256_set1_pd(4.0), two = _mm256_set1_pd(2.0);
+	__m256i count = _mm256_setzero_si256();
+	long long out[4];
+	int i, k, inside = 0, check = PERIOD_FIRST_CHECK;
+
+	for (k = 0; k < 4; k++)
+		inside |= in_cardioid_or_bulb(px[k], py[k]) << k;
+	alive = _mm256_castsi256_pd(_mm256_set_epi64x(
+		inside & 8 ? 0 : -1, inside & 4 ? 0 : -1, inside & 2 ? 0 : -1, inside & 1 ? 0 : -1));
+
+	for (i = 0; i < max; i++) {
+		xx = _mm256_mul_pd(x, x);
+		yy = _mm256_mul_pd(y, y);
+		alive = _mm256_and_pd(alive, _mm256_cmp_pd(_mm256_add_pd(xx, yy), four, _CMP_LE_OQ));
+		if (_mm256_movemask_pd(alive) == 0)
+			break;
+
+		/* alive lanes are all ones, i.e. -1 */
+		count = _mm256_sub_epi64(count, _mm256_castpd_si256(alive));
+
+		xt = _mm256_add_pd(_mm256_sub_pd(xx, yy), x0);
+		yt = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(two, x), y), y0);
+		x = _mm256_blendv_pd(x, xt, alive);
+		y = _mm256_blendv_pd(y, yt, alive);
+
+		if (max <= PERIOD_MIN_MAX)
+			continue;
+
+		/* lanes back at their saved point never escape */
+		cycled = _mm256_and_pd(alive, _mm256_and_pd(_mm256_cmp_pd(x, xs, _CMP_EQ_OQ),
+			_mm256_cmp_pd(y, ys, _CMP_EQ_OQ)));
+		if (_mm256_movemask_pd(cycled)) {
+			inside |= _mm256_movemask_pd(cycled);
+			alive = _mm256_andnot_pd(cycled, alive);
+		}
+		if (i + 1 == check) {
+			xs = x;
+			ys = y;
+			check *= 2;
+		}
+	}
+
+	_mm256_storeu_si256((__m256i *)out, count);
+	for (k = 0; k < 4; k++)
+		iter[k] = inside & (1 << k) ? max : out[k];
+}
+
+AVX512_KERNEL KERNEL_BODY void mandel_iterations_avx512(const double *px, const double *py, int *iter, int max)
+{
+	__m512d x0 = _mm512_loadu_pd(px), y0 = _mm512_loadu_pd(py);
+	__m512d x = x0, y = y0, xs = x0, ys = y0, xx, yy, xt, yt;
+	__m512d four = _mm512_set1_pd(4.0), two = _mm512_set1_pd(2.0);
+	__m512i count = _mm512_setzero_si512(), one = _mm512_set1_epi64(1);
+	__mmask8 alive, cycled, inside = 0;
+	int i, k, check = PERIOD_FIRST_CHECK;
+
+	for (k = 0; k < 8; k++)
+		inside |= in_cardioid_or_bulb(px[k], py[k]) << k;
+	alive = ~inside;
+
+	for (i = 0; i < max; i++) {
+		xx = _mm512_mul_pd(x, x);
+		yy = _mm512_mul_pd(y, y);
+		alive = _mm512_mask_cmp_pd_mask(alive, _mm512_add_pd(xx, yy), four, _CMP_LE_OQ);
+		if (alive == 0)
+			break;
+
+		count = _mm512_mask_add_epi64(count, alive, count, one);
+
+		xt = _mm512_add_pd(_mm512_sub_pd(xx, yy), x0);
+		yt = _mm512_add_pd(_mm512_mul_pd(_mm512_mul_pd(two, x), y), y0);
+		x = _mm512_mask_mov_pd(x, alive, xt);
+		y = _mm512_mask_mov_pd(y, alive, yt);
+
+		if (max <= PERIOD_MIN_MAX)
+			continue;
+
+		/* lanes back at their saved point never escape */
+		cycled = _mm512_mask_cmp_pd_mask(_mm512_mask_cmp_pd_mask(alive, x, xs, _CMP_EQ_OQ),
+			y, ys, _CMP_EQ_OQ);
+		inside |= cycled;
+		alive &= ~cycled;
+		if (i + 1 == check) {
+			xs = x;
+			ys = y;
+			check *= 2;
+		}
+	}
+
+	count = _mm512_mask_mov_epi64(count, inside, _mm512_set1_epi64(max));
+	_mm256_storeu_si256((__m256i *)iter, _mm512_cvtepi64_epi32(count));
+}
+
+#endif
+
+enum mandel_kernel {
+	KERNEL_SCALAR,
+	KERNEL_AVX2,
+	KERNEL_AVX512,
+	NR_KERNELS
+};
+
+static const char *kernel_names[NR_KERNELS] = {
+	[KERNEL_SCALAR] = "scalar",
+	[KERNEL_AVX2] = "avx2",
+	[KERNEL_AVX512] = "avx512",
+};
+
+/* lanes of each kernel */
+static const int kernel_width[NR_KERNELS] = {
+	[KERNEL_SCALAR] = 1,
+	[KERNEL_AVX2] = 4,
+	[KERNEL_AVX512] = 8,
+};
+
+/* picked by select_kernel(), once, by whichever thread gets there first */
+static int kernel;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+/* A kernel computes kernel_width[] points at a time */
+typedef void (*kernel_fn)(const double *px, const double *py, int *iter, int max);
+
+/*
+ * Defines the kernels for an iteration cap: mandel_iterations_scalar_##name()
+ * and so on, with max replaced by cap, and their table.
+ */
+#define DEFINE_SCALAR_KERNEL(name, cap)							\
+static void mandel_iterations_scalar_##name(const double *px, const double *py,	\
+	int *iter, int max)								\
+{											\
+	*iter = iterations_at_point(*px, *py, cap);					\
+}
+
+#ifdef MANDEL_VECTOR_KERNELS
+#define DEFINE_KERNELS(name, cap)							\
+DEFINE_SCALAR_KERNEL(name, cap)								\
+AVX2_KERNEL static void mandel_iterations_avx2_##name(const double *px,		\
+	const double *py, int *iter, int max)						\
+{											\
+	mandel_iterations_avx2(px, py, iter, cap);					\
+}											\
+AVX512_KERNEL static void mandel_iterations_avx512_##name(const double *px,		\
+	const double *py, int *iter, int max)						\
+{											\
+	mandel_iterations_avx512(px, py, iter, cap);					\
+}											\
+static const kernel_fn kernels_##name[NR_KERNELS] = {					\
+	[KERNEL_SCALAR] = mandel_iterations_scalar_##name,				\
+	[KERNEL_AVX2] = mandel_iterations_avx2_##name,					\
+	[KERNEL_AVX512] = mandel_iterations_avx512_##name,				\
+};
+#else
+#define DEFINE_KERNELS(name, cap)							\
+DEFINE_SCALAR_KERNEL(name, cap)								\
+static const kernel_fn kernels_##name[NR_KERNELS] = {					\
+	[KERNEL_SCALAR] = mandel_iterations_scalar_##name,				\
+};
+#endif
+
+/*
+ * The iteration caps with kernels of their own: the 8-bit palette's, round
+ * numbers, and MANDEL_MAX_ITERATION of the programs. Any other max goes to
+ * kernels_any, which takes it as an argument.
+ */
+#define MANDEL_CAPS(CAP) CAP(256) CAP(1000) CAP(10000) CAP(100000)
+
+#define DEFINE_CAP_KERNELS(cap) DEFINE_KERNELS(cap, cap)
+MANDEL_CAPS(DEFINE_CAP_KERNELS)
+DEFINE_KERNELS(any, max)
+
+static const kernel_fn *kernels_for(int max)
+{
+	switch (max) {
+#define CAP_CASE(cap) case cap: return kernels_##cap;
+	MANDEL_CAPS(CAP_CASE)
+#undef CAP_CASE
+	default:
+		return kernels_any;
+	}
+}
+
+/*
+ * Picks the widest kernel the CPU supports (cpuid, through
+ * __builtin_cpu_supports(), which also checks that the OS saves the
+ * vector registers). MANDEL_KERNEL=scalar|avx2|avx512 in the environment
+ * overrides the choice, e.g. to compare them; asking for a kernel the CPU
+ * cannot run falls back to the best one it can.
+ */
+static void select_kernel(void)
+{
+	const char *env = getenv("MANDEL_KERNEL");
+	int best = KERNEL_SCALAR, choice, k;
+
+#ifdef MANDEL_VECTOR_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		best = KERNEL_AVX512;
+	else if (__builtin_cpu_supports("avx2"))
+		best = KERNEL_AVX2;
+#endif
+
+	choice = best;
+	if (env != NULL)
+		for (k = 0; k < NR_KERNELS; k++)
+			if (strcmp(env, kernel_names[k]) == 0 && k <= best)
+				choice = k;
+	kernel = choice;
+}
+
+const char *mandel_kernel_name(void)
+{
+	pthread_once(&kernel_once, select_kernel);
+	return kernel_names[kernel];
+}
+
+/*
+ * This function computes the iterations of n points at once,
+ * exactly as n calls to mandel_iterations_at_point() would,
+ * with the vector kernel the CPU supports.
+ */
+void mandel_iterations_at_points(const double *x, const double *y, int *iter, int n, int max)
+{
+	const kernel_fn *kernels = kernels_for(max);
+	int i = 0;
+
+	pthread_once(&kernel_once, select_kernel);
+
+	for (; i + kernel_width[kernel] <= n; i += kernel_width[kernel])
+		kernels[kernel](x + i, y + i, iter + i, max);
+
+	/* what is left over, less than a vector */
+	for (; i < n; i++)
+		kernels[KERNEL_SCALAR](x + i, y + i, iter + i, max);
+}
+
+/*******************************************
+ *                                         *
+ * The view: what to draw, set at run time *
+ *                                         *
+ *******************************************/
+
+/* the largest width or height, so that no size in a frame overflows */
+#define VIEW_MAX_SIZE	65536
+
+#define VIEW_LINE_SIZE	256
+
+static int parse_int(const char *s, int min, int max, int *val)
+{
+	long l;
+	char *endp;
+
+	l = strtol(s, &endp, 10);
+	if (s == endp || *endp != '\0' || l < min || l > max)
+		return -1;
+	*val = l;
+	return 0;
+}
+
+static int parse_double(const char *s, double *val)
+{
+	double d;
+	char *endp;
+
+	d = strtod(s, &endp);
+	if (s == endp || *endp != '\0' || !isfinite(d))
+		return -1;
+	*val = d;
+	return 0;
+}
+
+/* Sets the parameter called name to value. Returns -1 if either is not valid. */
+static int set_view_param(struct mandel_view *view, const char *name, const char *value)
+{
+	if (strcmp(name, "width") == 0)
+		return parse_int(value, 1, VIEW_MAX_SIZE, &view->width);
+	if (strcmp(name, "height") == 0)
+		return parse_int(value, 1, VIEW_MAX_SIZE, &view->height);
+	if (strcmp(name, "max_iteration") == 0)
+		return parse_int(value, 0, INT_MAX, &view->max_iteration);
+	if (strcmp(name, "xmin") == 0)
+		return parse_double(value, &view->xmin);
+	if (strcmp(name, "xmax") == 0)
+		return parse_double(value, &view->xmax);
+	if (strcmp(name, "ymin") == 0)
+		return parse_double(value, &view->ymin);
+	if (strcmp(name, "ymax") == 0)
+		return parse_double(value, &view->ymax);
+	return -1;
+}
+
+static int check_region(const struct mandel_view *view)
+{
+	if (view->xmin < view->xmax && view->ymin < view->ymax)
+		return 0;
+	fprintf(stderr, "the region must have xmin < xmax and ymin < ymax\n");
+	return -1;
+}
+
+/*
+ * Reads a view from filename: a `name = value' per line, where name is
+ * width, height, xmin, xmax, ymin, ymax or max_iteration, # starts a
+ * comment. What the file leaves out stays as it is in *view.
+ */
+int mandel_load_view(const char *filename, struct mandel_view *view)
+{
+	char line[VIEW_LINE_SIZE], name[VIEW_LINE_SIZE], value[VIEW_LINE_SIZE];
+	char extra[VIEW_LINE_SIZE], *p;
+	int lineno = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (f == NULL) {
+		perror(filename);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		p = strchr(line, '#');
+		if (p != NULL)
+			*p = '\0';
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+		if (*p == '\n' || *p == '\0')
+			continue;
+		if (sscanf(p, "%[a-z_] = %s %s", name, value, extra) != 2 ||
+		    set_view_param(view, name, value) < 0) {
+			fprintf(stderr, "%s:%d: expected `name = value', with a valid name and value\n",
+				filename, lineno);
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+
+	return check_region(view);
+}
+
+/*
+ * Handles a getopt() option of MANDEL_VIEW_OPTIONS, with its argument.
+ * Returns 0 if it was handled, -1 if the argument is not valid and 1 if
+ * the option is not a view option.
+ */
+int mandel_view_option(struct mandel_view *view, int opt, const char *arg)
+{
+	struct mandel_view region = *view;
+	char extra;
+	int ret;
+
+	switch (opt) {
+	case 'W':
+		ret = set_view_param(view, "width", arg);
+		break;
+	case 'H':
+		ret = set_view_param(view, "height", arg);
+		break;
+	case 'I':
+		ret = set_view_param(view, "max_iteration", arg);
+		break;
+	case 'R':
+		ret = -1;
+		if (sscanf(arg, "%lf,%lf,%lf,%lf%c", &region.xmin, &region.xmax,
+		    &region.ymin, &region.ymax, &extra) == 4 &&
+		    isfinite(region.xmin) && isfinite(region.xmax) &&
+		    isfinite(region.ymin) && isfinite(region.ymax)) {
+			ret = check_region(&region);
+			if (ret == 0)
+				*view = region;
+		}
+		break;
+	case 'F':
+		return mandel_load_view(arg, view);
+	default:
+		return 1;
+	}
+
+	if (ret < 0)
+		fprintf(stderr, "`%s' is not valid for `-%c'\n", arg, opt);
+	return ret;
+}
+
+/*******************************************
+ *                                         *
+ * Baked palettes: color value -> xterm    *
+ *                                         *
+ *******************************************/
+
+/*
+ * The nearest xterm color of every one of the 256 color values, found
+ * once per palette instead of once per pixel. It is baked from mandel256
+ * (or from the file named by MANDEL_PALETTE in the environment) on the
+ * first call to xterm_color(), or by mandel_load_palette().
+ * The colors themselves are kept too, for images.
+ */
+static unsigned char palette_lut[256];
+static unsigned char palette_rgb[256 * 3];
+static pthread_once_t palette_once = PTHREAD_ONCE_INIT;
+
+#define PALETTE_LINE_SIZE 256
+
+/*
+ * Bakes a palette of n colors, 1 <= n <= 256, with components in [0, 1].
+ * With fewer than 256 colors, they are stretched over all color values.
+ */
+static void bake_palette(double (*colors)[3], int n)
+{
+	unsigned char rgb[3];
+	int val, i;
+
+	for (val = 0; val < 256; val++) {
+		i = val * n / 256;
+		rgb[0] = 255.0 * colors[i][0];
+		rgb[1] = 255.0 * colors[i][1];
+		rgb[2] = 255.0 * colors[i][2];
+		palette_lut[val] = rgb2xterm(rgb);
+		memcpy(&palette_rgb[3 * val], rgb, 3);
+	}
+}
+
+static int load_palette(const char *filename)
+{
+	double colors[256][3];
+	char line[PALETTE_LINE_SIZE], *p;
+	int n = 0, lineno = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (f == NULL) {
+		perror(filename);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+		if (n == 256) {
+			fprintf(stderr, "%s:%d: more than 256 colors\n", filename, lineno);
+			fclose(f);
+			return -1;
+		}
+		if (sscanf(p, "%lf %lf %lf", &colors[n][0], &colors[n][1], &colors[n][2]) != 3 ||
+		    colors[n][0] < 0 || colors[n][0] > 1 || colors[n][1] < 0 || colors[n][1] > 1 ||
+		    colors[n][2] < 0 || colors[n][2] > 1) {
+			fprintf(stderr, "%s:%d: expected `red green blue', from 0.0 to 1.0\n",
+				filename, lineno);
+			fclose(f);
+			return -1;
+		}
+		n++;
+	}
+	fclose(f);
+
+	if (n == 0) {
+		fprintf(stderr, "%s: no colors\n", filename);
+		return -1;
+	}
+	bake_palette(colors, n);
+	return 0;
+}
+
+static void bake_default_palette(void)
+{
+	double colors[256][3];
+	const char *filename = getenv("MANDEL_PALETTE");
+	int i;
+
+	if (filename != NULL) {
+		if (load_palette(filename) < 0)
+			exit(1);
+		return;
+	}
+
+	for (i = 0; i < 256; i++) {
+		colors[i][0] = mandel256[i].red;
+		colors[i][1] = mandel256[i].green;
+		colors[i][2] = mandel256[i].blue;
+	}
+	bake_palette(colors, 256);
+}
+
+/*
+ * Replaces the palette with the one in filename: one color per line,
+ * `red green blue' from 0.0 to 1.0, up to 256 of them, # starts a comment.
+ * It must be called before any thread calls xterm_color().
+ */
+int mandel_load_palette(const char *filename)
+{
+	pthread_once(&palette_once, bake_default_palette);
+	return load_palette(filename);
+}
+
 /*
  * This function takes a color value as returned
  * by mandelbrot_iterations() and uses the 256-color
@@ -424,18 +1039,23 @@ int mandel_iterations_at_point(double x, double y, int max)
  */
 unsigned char xterm_color(int color_val)
 {
-	unsigned char rgb[3];
+	pthread_once(&palette_once, bake_default_palette);
 
 	if (color_val > 255)
 		color_val = 255;
 
-	rgb[0] = 255.0 * mandel256[color_val].red;
-	rgb[1] = 255.0 * mandel256[color_val].green;
-	rgb[2] = 255.0 * mandel256[color_val].blue;
-	color_val = rgb2xterm(rgb);
-	
-	assert(0 <= color_val && color_val <= 255);
-	return color_val;
+	return palette_lut[color_val];
+}
+
+/*
+ * Returns the palette as 256 red, green, blue triplets, one per color
+ * value, for true-color output. Like xterm_color(), it bakes the palette
+ * on the first call.
+ */
+const unsigned char *mandel_palette_rgb(void)
+{
+	pthread_once(&palette_once, bake_default_palette);
+	return palette_rgb;
 }
 
 /*
@@ -458,6 +1078,71 @@ ssize_t insist_write(int fd, const char *buf, size_t count)
 	return orig_count;
 }
 
+/*
+ * Writes all iovcnt buffers of iov to fd, with as few writev() calls as
+ * the kernel allows (one, unless it writes less or iovcnt > IOV_MAX).
+ * iov is used as scratch space. Returns the number of writev() calls,
+ * or -1 on error.
+ */
+int insist_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t ret;
+	int calls = 0;
+
+	while (iovcnt > 0) {
+		ret = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+		if (ret < 0)
+			return -1;
+		calls++;
+
+		/* skip what was written, which may end in the middle of a buffer */
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return calls;
+}
+
+/*
+ * Encodes a line of n color values as n '@' characters and a newline,
+ * like set_xterm_color() and a write() per point would, but with a color
+ * escape only where the color changes. *color is the color the terminal
+ * is set to, -1 if it is not known, and is updated. buf must have room
+ * for XTERM_LINE_SIZE(n) bytes. Returns the number of bytes stored.
+ */
+size_t xterm_encode_line(char *buf, const int color_val[], int n, int *color)
+{
+	char *p = buf;
+	int i, c;
+
+	for (i = 0; i < n; i++) {
+		c = color_val[i];
+		if (c != *color) {
+			/* "\033[38;5;%dm", without snprintf() */
+			memcpy(p, "\033[38;5;", 7);
+			p += 7;
+			if (c >= 100)
+				*p++ = '0' + c / 100;
+			if (c >= 10)
+				*p++ = '0' + c / 10 % 10;
+			*p++ = '0' + c % 10;
+			*p++ = 'm';
+			*color = c;
+		}
+		*p++ = '@';
+	}
+	*p++ = '\n';
+
+	return p - buf;
+}
+
 /*
  * This function outputs the proper control sequence
  * to change the current color of a 256-color xterm.
@@ -9,10 +9,53 @@
 #ifndef MANDEL_LIB_H__
 #define MANDEL_LIB_H__
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * An encoded line of n points is at most a color escape,
+ * "\033[38;5;255m", and a character per point, and a newline.
+ */
+#define XTERM_ESCAPE_SIZE	11
+#define XTERM_LINE_SIZE(n)	((n) * (XTERM_ESCAPE_SIZE + 1) + 1)
+
+/*
+ * What to draw: the part of the complex plane with upper left corner
+ * (xmin, ymax) and lower right corner (xmax, ymin), at width x height
+ * points, with up to max_iteration iterations per point.
+ */
+struct mandel_view {
+	int width, height;
+	double xmin, xmax, ymin, ymax;
+	int max_iteration;
+};
+
+#define MANDEL_VIEW_DEFAULT	{ 90, 50, -1.8, 1.0, -1.0, 1.0, 100000 }
+
+/* The getopt() options mandel_view_option() takes, and their usage */
+#define MANDEL_VIEW_OPTIONS	"W:H:R:I:F:"
+#define MANDEL_VIEW_USAGE \
+	"    -W WIDTH, -H HEIGHT: The size of the frame (default 90 x 50).\n" \
+	"    -R XMIN,XMAX,YMIN,YMAX: The part of the complex plane to draw\n" \
+	"                            (default -1.8,1.0,-1.0,1.0).\n" \
+	"    -I MAX_ITERATION: Iterations before a point counts as inside\n" \
+	"                      the set (default 100000).\n" \
+	"    -F FILE: Read the view from FILE, a `name = value' per line, for\n" \
+	"             width, height, xmin, xmax, ymin, ymax and max_iteration.\n"
+
 /* Function prototypes */
+int mandel_view_option(struct mandel_view *view, int opt, const char *arg);
+int mandel_load_view(const char *filename, struct mandel_view *view);
+int mandel_iterations_brute_force(double x, double y, int max);
 int mandel_iterations_at_point(double x, double y, int max);
+void mandel_iterations_at_points(const double *x, const double *y, int *iter, int n, int max);
+const char *mandel_kernel_name(void);
 unsigned char xterm_color(int color_val);
+const unsigned char *mandel_palette_rgb(void);
+int mandel_load_palette(const char *filename);
 ssize_t insist_write(int fd, const char *buf, size_t count);
+int insist_writev(int fd, struct iovec *iov, int iovcnt);
+size_t xterm_encode_line(char *buf, const int color_val[], int n, int *color);
 void set_xterm_color(int fd, unsigned char color);
 void reset_xterm_color(int fd);
 
@@ -53,6 +53,9 @@ double ymin = -1.0, ymax = 1.0;
 double xstep;
 double ystep;
 
+/* The color the terminal is set to, -1 until the first line is out */
+int terminal_color = -1;
+
 int NTHREADS;
 sem_t NUM;
 
@@ -95,6 +98,7 @@ void compute_mandel_line(int line, int color_val[])
          * x and y traverse the complex plane.
          */
         double x, y;
+        double xs[x_chars], ys[x_chars];
 
         int n;
         int val;
@@ -102,44 +106,38 @@ void compute_mandel_line(int line, int color_val[])
         /* Find out the y value corresponding to this line */
         y = ymax - ystep * line;
 
-        /* and iterate for all points on this line */
+        /* collect the points on this line, then iterate for all of them at once */
         for (x = xmin, n = 0; n < x_chars; x+= xstep, n++) {
+                xs[n] = x;
+                ys[n] = y;
+        }
+        mandel_iterations_at_points(xs, ys, color_val, x_chars, MANDEL_MAX_ITERATION);
 
-                /* Compute the point's color value */
-                val = mandel_iterations_at_point(x, y, MANDEL_MAX_ITERATION);
+        for (n = 0; n < x_chars; n++) {
+                /* Turn the point's iterations into a color value */
+                val = color_val[n];
                 if (val > 255)
                         val = 255;
 
                 /* And store it in the color_val[] array */
-                val = xterm_color(val);
-                color_val[n] = val;
+                color_val[n] = xterm_color(val);
         }
 }
 
 /*
  * This function outputs an array of x_char color values
- * to a 256-color xterm.
+ * to a 256-color xterm, with a single write() and a color
+ * escape only where the color changes.
  */
 void output_mandel_line(int fd, int color_val[])
 {
-        int i;
-
-        char point ='@';
-        char newline='\n';
-
-        for (i = 0; i < x_chars; i++) {
-                /* Set the current color, then output the point */
-                set_xterm_color(fd, color_val[i]);
-                if (write(fd, &point, 1) != 1) {
-                        perror("compute_and_output_mandel_line: write point");
-                        exit(1);
-                }
-        }
-
+        char buf[XTERM_LINE_SIZE(x_chars)];
+        size_t len;
 
-        /* Now that the line is done, output a newline character */
-        if (write(fd, &newline, 1) != 1) {
-                perror("compute_and_output_mandel_line: write newline");
+        /* Lines are output one at a time, in order, so they share the color */
+        len = xterm_encode_line(buf, color_val, x_chars, &terminal_color);
+        if (insist_write(fd, buf, len) != len) {
+                perror("output_mandel_line: insist_write");
                 exit(1);
         }
 }
@@ -3,7 +3,33 @@
  *
  * A program to draw the Mandelbrot Set on a 256-color xterm, using multiple threads.
  *
- * To sychronize the threads it uses one semaphore.
+ * The threads that compute lines do not output them: they deposit them
+ * in a reorder buffer of WINDOW slots and go on with the next one, and a
+ * writer thread outputs the lines in order as soon as the next one is
+ * there. A thread only waits if its line is WINDOW or more lines ahead
+ * of the output, which bounds the memory used.
+ *
+ * Lines are handed out in chunks: statically, round robin, or dynamically,
+ * with each thread claiming the next chunk from a shared cursor when it is
+ * done with the last one, so that the threads that get the slow lines
+ * through the set do not hold up the others. Guided scheduling claims
+ * large chunks first and smaller ones towards the end.
+ *
+ * With -t, the threads claim square tiles of a framebuffer of iteration
+ * counts instead of lines, and the frame is colored and output once all
+ * of them are in.
+ *
+ * With -m, the frame is rendered with the Mariani-Silver algorithm: the
+ * threads take rectangles whose border is known from a shared stack, and
+ * fill them in or cut them in two and push the halves back. The frame
+ * can differ from the other modes in a few points, so -m needs -a too.
+ *
+ * The view, its size and the iteration cap can be given on the command
+ * line or in a file; see MANDEL_VIEW_USAGE in mandel-lib.h.
+ *
+ * With -o, the frame is stored in a PPM or PGM image instead, mapped in
+ * memory: every thread stores the lines or tiles it computed in place,
+ * and there is no writer thread.
  */
 
 #include <errno.h>
@@ -13,12 +39,12 @@
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
-#include <semaphore.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "mandel-lib.h"
-
-#define MANDEL_MAX_ITERATION 100000
+#include "mandel-fb.h"
+#include "mandel-image.h"
 
 /* 
  * POSIX thread functions do not return error numbers in errno,
@@ -28,22 +54,26 @@
 #define perror_pthread(ret, msg) \
         do { errno = ret; perror(msg); } while (0)
 
-/***************************
- * Compile-time parameters *
- ***************************/
+/***********************************************
+ * Run-time parameters, set by main() from the *
+ * command line, MANDEL_VIEW_DEFAULT otherwise *
+ ***********************************************/
 
 /*
  * Output at the terminal is is x_chars wide by y_chars long
 */
-int y_chars = 50;
-int x_chars = 90;
+int y_chars;
+int x_chars;
 
 /*
  * The part of the complex plane to be drawn:
  * upper left corner is (xmin, ymax), lower right corner is (xmax, ymin)
 */
-double xmin = -1.8, xmax = 1.0;
-double ymin = -1.0, ymax = 1.0;
+double xmin, xmax;
+double ymin, ymax;
+
+/* Iterations before a point counts as inside the set */
+int max_iteration;
 
 /*
  * Every character in the final output is
@@ -52,17 +82,96 @@ double ymin = -1.0, ymax = 1.0;
 double xstep;
 double ystep;
 
+/* The color the terminal is set to, -1 until the first line is out */
+int terminal_color = -1;
+
 int NTHREADS;
-sem_t NUM;
+
+/*
+ * The reorder buffer: line i goes to slot i % window, once every line
+ * before i - window has been written out.
+ */
+struct reorder_buffer {
+        int window;
+        int *color_val;         /* window slots of x_chars color values */
+        int *slot_line;         /* the line in each slot, -1 if empty */
+        int written;            /* lines output so far */
+        pthread_mutex_t lock;
+        pthread_cond_t line_ready;      /* signalled when line `written' arrives */
+        pthread_cond_t slot_free;       /* broadcast when `written' moves */
+};
+
+struct reorder_buffer rob;
+
+enum schedule {
+        SCHED_STATIC,           /* chunk k goes to thread k % NTHREADS */
+        SCHED_DYNAMIC,          /* the next chunk goes to the first thread to ask */
+        SCHED_GUIDED,           /* the same, with chunks of remaining / NTHREADS lines */
+};
+
+enum schedule schedule = SCHED_DYNAMIC;
+int chunk = 1;
+
+/* The first line not claimed yet, for dynamic and guided scheduling */
+int next_line = 0;
+
+/* The frame and its tiles, with -t */
+struct framebuffer *fb;
+struct tile_sched tiles;
+
+/*
+ * The rectangles waiting to be done, with -m. Threads take the last one
+ * pushed, so that they go depth first and the stack stays short.
+ */
+struct rect_stack {
+        struct tile *rects;
+        int n, size;
+        int busy;               /* threads doing a rectangle, which may push more */
+        pthread_mutex_t lock;
+        pthread_cond_t more;    /* signalled on a push, broadcast when all are done */
+};
+
+struct rect_stack ms;
+
+/* The image the frame goes to, with -o; NULL for the terminal */
+struct image *image;
+
+/* The first line not stored in the image yet, with -m */
+int next_image_line = 0;
+
+struct thread_info {
+        int id;
+        int chunks_done;        /* for static scheduling */
+        int lines;              /* lines computed */
+        int tiles;              /* tiles computed, with -t */
+        int rects;              /* rectangles done, with -m */
+        long points;            /* points computed */
+        double busy_ms;         /* time spent computing them */
+};
 
 /*
  * Function for usage of the executable from pthread-test.c 
  */
 void usage(char *argv0)
 {
-        fprintf(stderr, "Usage: %s NTHREADS\n\n"
-                        "Exactly one argument required:\n"
-                        "    NTHREADS: The number of threads to create.\n",
+        fprintf(stderr, "Usage: %s [-s | -g] [-c CHUNK] [-w WINDOW] [-t TILE | -m -a] [-o FILE]\n"
+                        "          [-W WIDTH] [-H HEIGHT] [-R XMIN,XMAX,YMIN,YMAX]\n"
+                        "          [-I MAX_ITERATION] [-F FILE] NTHREADS\n\n"
+                        "    NTHREADS: The number of threads to create.\n"
+                        "    -c CHUNK: Lines per chunk (default 1), the smallest chunk with -g.\n"
+                        "    -w WINDOW: Lines that can wait to be output (default 4 * NTHREADS).\n"
+                        "    -s: Static scheduling, chunks are dealt round robin.\n"
+                        "    -g: Guided scheduling, chunks shrink as the frame fills.\n"
+                        "    Without -s or -g, threads claim the next chunk when they are done.\n"
+                        "    -t TILE: Compute TILE x TILE tiles of the frame instead of lines,\n"
+                        "             and output the frame when it is complete.\n"
+                        "    -m: Render the frame with the Mariani-Silver algorithm,\n"
+                        "        and output it when it is complete.\n"
+                        "    -a: Accept that -m is approximate: a filament thinner than\n"
+                        "        a point can be filled over, so a few points may differ.\n"
+                        "    -o FILE: Store the frame in FILE, a binary .ppm (color)\n"
+                        "             or .pgm (gray) image, instead of drawing it.\n"
+                        MANDEL_VIEW_USAGE,
                         argv0);
         exit(1);
 }
@@ -85,116 +194,243 @@ int safe_atoi(char *s, int *val)
 
 
 /*
- * This function computes a line of output
- * as an array of x_char color values.
+ * This function computes the iterations of
+ * the x_chars points of a line.
  */
-void compute_mandel_line(int line, int color_val[])
+void compute_mandel_iterations(int line, int iter[])
 {
         /*
          * x and y traverse the complex plane.
          */
         double x, y;
+        double xs[x_chars], ys[x_chars];
 
         int n;
-        int val;
 
         /* Find out the y value corresponding to this line */
         y = ymax - ystep * line;
 
-        /* and iterate for all points on this line */
+        /* collect the points on this line, then iterate for all of them at once */
         for (x = xmin, n = 0; n < x_chars; x+= xstep, n++) {
+                xs[n] = x;
+                ys[n] = y;
+        }
+        mandel_iterations_at_points(xs, ys, iter, x_chars, max_iteration);
+}
 
-                /* Compute the point's color value */
-                val = mandel_iterations_at_point(x, y, MANDEL_MAX_ITERATION);
+/*
+ * This function computes a line of output
+ * as an array of x_char color values.
+ */
+void compute_mandel_line(int line, int color_val[])
+{
+        int n;
+        int val;
+
+        compute_mandel_iterations(line, color_val);
+
+        for (n = 0; n < x_chars; n++) {
+                /* Turn the point's iterations into a color value */
+                val = color_val[n];
                 if (val > 255)
                         val = 255;
 
                 /* And store it in the color_val[] array */
-                val = xterm_color(val);
-                color_val[n] = val;
+                color_val[n] = xterm_color(val);
         }
 }
 
+double now_ms(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
 /*
- * This function outputs an array of x_char color values
- * to a 256-color xterm.
+ * Claims the next chunk of lines for a thread, according to the schedule.
+ * Returns the number of lines in it, starting at *first, 0 when the frame is done.
  */
-void output_mandel_line(int fd, int color_val[])
+int claim_lines(struct thread_info *info, int *first)
 {
-        int i;
+        int n;
+
+        switch (schedule) {
+        case SCHED_STATIC:
+                *first = (info->chunks_done++ * NTHREADS + info->id) * chunk;
+                break;
+        case SCHED_DYNAMIC:
+                *first = __sync_fetch_and_add(&next_line, chunk);
+                break;
+        case SCHED_GUIDED:
+                do {
+                        *first = next_line;
+                        if (*first >= y_chars)
+                                return 0;
+                        n = (y_chars - *first) / NTHREADS;
+                        if (n < chunk)
+                                n = chunk;
+                } while (!__sync_bool_compare_and_swap(&next_line, *first, *first + n));
+                return *first + n < y_chars ? n : y_chars - *first;
+        }
+
+        if (*first >= y_chars)
+                return 0;
+        return *first + chunk < y_chars ? chunk : y_chars - *first;
+}
+
+/*
+ * Puts a computed line in its slot, waiting for the slot to be free.
+ *
+ * This cannot deadlock: every thread goes through its lines in order and
+ * lines are claimed in order, so the first line not written yet is always
+ * the one some thread is working on, and its slot is free.
+ */
+void deposit_line(int line, int color_val[])
+{
+        int slot = line % rob.window;
+
+        pthread_mutex_lock(&rob.lock);
+        while (line >= rob.written + rob.window)
+                pthread_cond_wait(&rob.slot_free, &rob.lock);
+        pthread_mutex_unlock(&rob.lock);
 
-        char point ='@';
-        char newline='\n';
+        /* the slot is ours until the writer gets to this line */
+        memcpy(&rob.color_val[(size_t)slot * x_chars], color_val, x_chars * sizeof(int));
 
-        for (i = 0; i < x_chars; i++) {
-                /* Set the current color, then output the point */
-                set_xterm_color(fd, color_val[i]);
-                if (write(fd, &point, 1) != 1) {
-                        perror("compute_and_output_mandel_line: write point");
+        pthread_mutex_lock(&rob.lock);
+        rob.slot_line[slot] = line;
+        if (line == rob.written)
+                pthread_cond_signal(&rob.line_ready);
+        pthread_mutex_unlock(&rob.lock);
+}
+
+/*
+ * The writer thread: outputs the lines in order, as soon as they arrive.
+ * It takes every line that is ready after the next one too, and outputs
+ * them with a single writev().
+ */
+void *write_mandel_lines(void *arg)
+{
+        int fd = 1; // Output is sent to file descriptor '1', i.e., standard output.
+        char *text;
+        struct iovec iov[rob.window];
+        int next = 0, n, slot;
+
+        text = malloc((size_t)rob.window * XTERM_LINE_SIZE(x_chars));
+        if (text == NULL) {
+                fprintf(stderr, "allocation failed\n");
+                exit(1);
+        }
+
+        while (next < y_chars) {
+                pthread_mutex_lock(&rob.lock);
+                while (rob.slot_line[next % rob.window] != next)
+                        pthread_cond_wait(&rob.line_ready, &rob.lock);
+                for (n = 1; n < rob.window && next + n < y_chars; n++)
+                        if (rob.slot_line[(next + n) % rob.window] != next + n)
+                                break;
+                pthread_mutex_unlock(&rob.lock);
+
+                /* Encode the lines, so that their slots can be reused */
+                for (slot = 0; slot < n; slot++) {
+                        iov[slot].iov_base = text + (size_t)slot * XTERM_LINE_SIZE(x_chars);
+                        iov[slot].iov_len = xterm_encode_line(iov[slot].iov_base,
+                                &rob.color_val[(size_t)((next + slot) % rob.window) * x_chars],
+                                x_chars, &terminal_color);
+                }
+
+                pthread_mutex_lock(&rob.lock);
+                next += n;
+                rob.written = next;
+                pthread_cond_broadcast(&rob.slot_free);
+                pthread_mutex_unlock(&rob.lock);
+
+                if (insist_writev(fd, iov, n) < 0) {
+                        perror("write_mandel_lines: insist_writev");
                         exit(1);
                 }
         }
 
-        /* Now that the line is done, output a newline character */
-        if (write(fd, &newline, 1) != 1) {
-                perror("compute_and_output_mandel_line: write newline");
-                exit(1);
-        }
+        free(text);
+        return NULL;
 }
 
-void *compute_and_output_mandel_lines_via_threads(void *arg)
+void *compute_mandel_lines_via_threads(void *arg)
 {
-        int i, value;
-        volatile int *line_start_of_this_thread = arg;
-        int line = *line_start_of_this_thread;
-	int fd = 1; // Output is sent to file descriptor '1', i.e., standard output.
+        int i, first, n;
+        struct thread_info *info = arg;
+        double start;
 	int color_val[x_chars]; // A temporary array, used to hold color values for the line being drawn
         
-	for (i = line; i < y_chars; i += NTHREADS) {
-                compute_mandel_line(i, color_val);
-
-		// Check if it's the correct line to print
-		while(1) {
-			sem_getvalue(&NUM,&value);
-			if (value == i) {
-				break;
-			}
-		}
-                output_mandel_line(fd, color_val);
-		sem_post(&NUM);
+        while ((n = claim_lines(info, &first)) > 0) {
+                for (i = first; i < first + n; i++) {
+                        start = now_ms();
+                        if (image) {
+                                /* the iterations, which image_store_line() colors itself */
+                                compute_mandel_iterations(i, color_val);
+                                image_store_line(image, i, color_val);
+                        } else
+                                compute_mandel_line(i, color_val);
+                        info->busy_ms += now_ms() - start;
+                        info->lines++;
+                        info->points += x_chars;
+
+                        if (!image)
+                                deposit_line(i, color_val);
+                }
         }
         return NULL;
 }
 
-int main(int argc, char *argv[])
+void init_reorder_buffer(int window)
 {
-        int ret, i;
-
-        if (argc != 2)
-                usage(argv[0]);
+        int i;
 
-        if (safe_atoi(argv[1], &NTHREADS) < 0 || NTHREADS <= 0) {
-                fprintf(stderr, "`%s' is not valid for `NTHREADS'\n", argv[1]);
+        rob.window = window ? window : 4 * NTHREADS;
+        rob.color_val = malloc((size_t)rob.window * x_chars * sizeof(int));
+        rob.slot_line = malloc(rob.window * sizeof(int));
+        if (rob.color_val == NULL || rob.slot_line == NULL) {
+                fprintf(stderr, "allocation failed\n");
                 exit(1);
         }
+        for (i = 0; i < rob.window; i++)
+                rob.slot_line[i] = -1;
+        rob.written = 0;
+        pthread_mutex_init(&rob.lock, NULL);
+        pthread_cond_init(&rob.line_ready, NULL);
+        pthread_cond_init(&rob.slot_free, NULL);
+}
 
+void destroy_reorder_buffer(void)
+{
+        pthread_mutex_destroy(&rob.lock);
+        pthread_cond_destroy(&rob.line_ready);
+        pthread_cond_destroy(&rob.slot_free);
+        free(rob.color_val);
+        free(rob.slot_line);
+}
 
-        xstep = (xmax - xmin) / x_chars;
-        ystep = (ymax - ymin) / y_chars;
-	
-	// Create the threads and their starting line
-        pthread_t t[NTHREADS];
-	int starting_line_of_thread[NTHREADS];
+/*
+ * Computes the frame a line at a time, with the writer thread
+ * outputting them, or with -o, the threads storing them in the image.
+ */
+void render_mandel_lines(struct thread_info info[], int window)
+{
+        pthread_t t[NTHREADS], writer;
+        int ret, i;
 
-	for(i = 0; i < NTHREADS; i++) {
-		starting_line_of_thread[i] = i;
-	} 
-	
-	// Initialize the semaphore
-        sem_init(&NUM, 0, 0); //line to print
-	
+        if (!image) {
+                init_reorder_buffer(window);
+                ret = pthread_create(&writer, NULL, write_mandel_lines, NULL);
+                if (ret) {
+                        perror_pthread(ret, "pthread_create");
+                        exit(1);
+                }
+        }
         for(i = 0; i < NTHREADS; i++) {
-                ret = pthread_create(&(t[i]), NULL, compute_and_output_mandel_lines_via_threads, &starting_line_of_thread[i]);
+                ret = pthread_create(&(t[i]), NULL, compute_mandel_lines_via_threads, &info[i]);
                 if (ret) {
                         perror_pthread(ret, "pthread_create");
                         exit(1);
@@ -207,10 +443,317 @@ int main(int argc, char *argv[])
                 if (ret)
                         perror_pthread(ret, "pthread_join");
         }
+
+        if (!image) {
+                ret = pthread_join(writer, NULL);
+                if (ret)
+                        perror_pthread(ret, "pthread_join");
+                destroy_reorder_buffer();
+                reset_xterm_color(1);
+        }
+}
+
+/* With -t: computes tiles until there are none left */
+void *compute_mandel_tiles_via_threads(void *arg)
+{
+        struct thread_info *info = arg;
+        struct tile t;
+        double start;
+
+        while (tile_claim(&tiles, fb, &t)) {
+                start = now_ms();
+                fb_render_tile(fb, &t, max_iteration);
+                if (image)
+                        image_store_tile(image, fb, &t);
+                info->busy_ms += now_ms() - start;
+                info->lines += t.h;
+                info->tiles++;
+                info->points += (long)t.w * t.h;
+        }
+        return NULL;
+}
+
+/*
+ * With -t: computes the frame in tiles, then colors and outputs it,
+ * unless the threads have stored the tiles in the image
+ */
+void render_mandel_tiles(struct thread_info info[], int tile)
+{
+        pthread_t t[NTHREADS];
+        int ret, i;
+
+        fb = fb_create(x_chars, y_chars, xmin, xmax, ymin, ymax);
+        if (fb == NULL) {
+                fprintf(stderr, "allocation failed\n");
+                exit(1);
+        }
+        tile_sched_init(&tiles, fb, tile);
+
+        for (i = 0; i < NTHREADS; i++) {
+                ret = pthread_create(&t[i], NULL, compute_mandel_tiles_via_threads, &info[i]);
+                if (ret) {
+                        perror_pthread(ret, "pthread_create");
+                        exit(1);
+                }
+        }
+        for (i = 0; i < NTHREADS; i++) {
+                ret = pthread_join(t[i], NULL);
+                if (ret)
+                        perror_pthread(ret, "pthread_join");
+        }
+
+        if (!image && fb_write_xterm(fb, 1) < 0) {
+                perror("render_mandel_tiles: fb_write_xterm");
+                exit(1);
+        }
+        fb_destroy(fb);
+}
+
+/* Pushes a rectangle on the stack, with ms.lock held */
+void push_rect(const struct tile *t)
+{
+        if (ms.n == ms.size) {
+                ms.size = ms.size ? 2 * ms.size : 64;
+                ms.rects = realloc(ms.rects, ms.size * sizeof(*ms.rects));
+                if (ms.rects == NULL) {
+                        fprintf(stderr, "allocation failed\n");
+                        exit(1);
+                }
+        }
+        ms.rects[ms.n++] = *t;
+        pthread_cond_signal(&ms.more);
+}
+
+/*
+ * With -m: does rectangles until the stack is empty
+ * and no other thread is doing one, which could push more.
+ */
+void *compute_mandel_rects_via_threads(void *arg)
+{
+        struct thread_info *info = arg;
+        struct tile t, child[2];
+        double start;
+        int i, n;
+
+        pthread_mutex_lock(&ms.lock);
+        for (;;) {
+                while (ms.n == 0 && ms.busy > 0)
+                        pthread_cond_wait(&ms.more, &ms.lock);
+                if (ms.n == 0)
+                        break;
+                t = ms.rects[--ms.n];
+                ms.busy++;
+                pthread_mutex_unlock(&ms.lock);
+
+                start = now_ms();
+                n = fb_ms_step(fb, &t, max_iteration, child, &info->points);
+                info->busy_ms += now_ms() - start;
+                info->rects++;
+
+                pthread_mutex_lock(&ms.lock);
+                for (i = 0; i < n; i++)
+                        push_rect(&child[i]);
+                ms.busy--;
+                if (ms.n == 0 && ms.busy == 0)
+                        pthread_cond_broadcast(&ms.more);
+        }
+        pthread_mutex_unlock(&ms.lock);
+
+        /*
+         * The frame is complete, as nothing is left to push more: store
+         * it in the image, with every thread claiming lines of it.
+         */
+        if (image)
+                while ((t.y0 = __sync_fetch_and_add(&next_image_line, 1)) < y_chars) {
+                        t.x0 = 0;
+                        t.w = x_chars;
+                        t.h = 1;
+                        image_store_tile(image, fb, &t);
+                }
+        return NULL;
+}
+
+/*
+ * With -m: computes the border of the frame, then has the threads do the
+ * rest, rectangle by rectangle, then colors and outputs it, unless the
+ * threads have stored it in the image. Returns the points computed for
+ * the border.
+ */
+long render_mandel_rects(struct thread_info info[])
+{
+        pthread_t t[NTHREADS];
+        struct tile frame;
+        long points;
+        int ret, i;
+
+        fb = fb_create(x_chars, y_chars, xmin, xmax, ymin, ymax);
+        if (fb == NULL) {
+                fprintf(stderr, "allocation failed\n");
+                exit(1);
+        }
+
+        pthread_mutex_init(&ms.lock, NULL);
+        pthread_cond_init(&ms.more, NULL);
+        points = fb_ms_begin(fb, &frame, max_iteration);
+        push_rect(&frame);
+
+        for (i = 0; i < NTHREADS; i++) {
+                ret = pthread_create(&t[i], NULL, compute_mandel_rects_via_threads, &info[i]);
+                if (ret) {
+                        perror_pthread(ret, "pthread_create");
+                        exit(1);
+                }
+        }
+        for (i = 0; i < NTHREADS; i++) {
+                ret = pthread_join(t[i], NULL);
+                if (ret)
+                        perror_pthread(ret, "pthread_join");
+        }
+
+        pthread_mutex_destroy(&ms.lock);
+        pthread_cond_destroy(&ms.more);
+        free(ms.rects);
+
+        if (!image && fb_write_xterm(fb, 1) < 0) {
+                perror("render_mandel_rects: fb_write_xterm");
+                exit(1);
+        }
+        fb_destroy(fb);
+        return points;
+}
+
+int main(int argc, char *argv[])
+{
+        struct mandel_view view = MANDEL_VIEW_DEFAULT;
+        int i, opt, ret, window = 0, tile = 0, mariani_silver = 0, approximate = 0;
+        char *image_file = NULL;
+        double start, total_busy, max_busy;
+        long points = 0;
+
+        while ((opt = getopt(argc, argv, "sgc:w:t:mao:" MANDEL_VIEW_OPTIONS)) != -1) {
+                switch (opt) {
+                case 's':
+                        schedule = SCHED_STATIC;
+                        break;
+                case 'g':
+                        schedule = SCHED_GUIDED;
+                        break;
+                case 'c':
+                        if (safe_atoi(optarg, &chunk) < 0 || chunk <= 0) {
+                                fprintf(stderr, "`%s' is not valid for `CHUNK'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'w':
+                        if (safe_atoi(optarg, &window) < 0 || window <= 0) {
+                                fprintf(stderr, "`%s' is not valid for `WINDOW'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 't':
+                        if (safe_atoi(optarg, &tile) < 0 || tile <= 0) {
+                                fprintf(stderr, "`%s' is not valid for `TILE'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'm':
+                        mariani_silver = 1;
+                        break;
+                case 'a':
+                        approximate = 1;
+                        break;
+                case 'o':
+                        image_file = optarg;
+                        break;
+                default:
+                        ret = mandel_view_option(&view, opt, optarg);
+                        if (ret < 0)
+                                exit(1);
+                        if (ret > 0)
+                                usage(argv[0]);
+                }
+        }
+        if (argc - optind != 1)
+                usage(argv[0]);
+        if (mariani_silver && !approximate) {
+                fprintf(stderr, "-m can differ from the other modes in a few points, "
+                        "add -a to accept that\n");
+                exit(1);
+        }
+        if (mariani_silver)
+                fprintf(stderr, "warning: -m is approximate, "
+                        "a few points may differ from the other modes\n");
+
+        if (safe_atoi(argv[optind], &NTHREADS) < 0 || NTHREADS <= 0) {
+                fprintf(stderr, "`%s' is not valid for `NTHREADS'\n", argv[optind]);
+                exit(1);
+        }
+
+
+        x_chars = view.width;
+        y_chars = view.height;
+        xmin = view.xmin;
+        xmax = view.xmax;
+        ymin = view.ymin;
+        ymax = view.ymax;
+        max_iteration = view.max_iteration;
+
+        xstep = (xmax - xmin) / x_chars;
+        ystep = (ymax - ymin) / y_chars;
 	
-	// Destroy the semaphore
-        sem_destroy(&NUM);
+	// The threads' bookkeeping
+	struct thread_info info[NTHREADS];
 
-        reset_xterm_color(1);
+	for(i = 0; i < NTHREADS; i++) {
+		info[i].id = i;
+		info[i].chunks_done = 0;
+		info[i].lines = 0;
+		info[i].tiles = 0;
+		info[i].rects = 0;
+		info[i].points = 0;
+		info[i].busy_ms = 0;
+	} 
+	
+        if (image_file) {
+                image = image_create(image_file, x_chars, y_chars);
+                if (image == NULL)
+                        exit(1);
+        }
+
+        start = now_ms();
+        if (mariani_silver)
+                points = render_mandel_rects(info);
+        else if (tile)
+                render_mandel_tiles(info, tile);
+        else
+                render_mandel_lines(info, window);
+        if (image && image_close(image) < 0) {
+                perror("image_close");
+                exit(1);
+        }
+        fprintf(stderr, "%d threads: frame rendered in %.3f ms\n", NTHREADS, now_ms() - start);
+
+        // Per-thread busy time, to show how well the load was balanced
+        total_busy = max_busy = 0;
+        for (i = 0; i < NTHREADS; i++) {
+                if (mariani_silver)
+                        fprintf(stderr, "thread %d: %d rectangles, busy %.3f ms\n",
+                                i, info[i].rects, info[i].busy_ms);
+                else if (tile)
+                        fprintf(stderr, "thread %d: %d tiles, busy %.3f ms\n",
+                                i, info[i].tiles, info[i].busy_ms);
+                else
+                        fprintf(stderr, "thread %d: %d lines, busy %.3f ms\n",
+                                i, info[i].lines, info[i].busy_ms);
+                total_busy += info[i].busy_ms;
+                points += info[i].points;
+                if (info[i].busy_ms > max_busy)
+                        max_busy = info[i].busy_ms;
+        }
+        if (total_busy > 0)
+                fprintf(stderr, "imbalance: busiest thread / mean = %.2f\n",
+                        max_busy / (total_busy / NTHREADS));
+        fprintf(stderr, "points computed: %ld of %ld (%.1f%%)\n",
+                points, (long)x_chars * y_chars, 100.0 * points / ((double)x_chars * y_chars));
         return 0;
 }
@@ -3,6 +3,9 @@
  *
  * A program to draw the Mandelbrot Set on a 256-color xterm.
  *
+ * The view, its size and the iteration cap can be given on the command
+ * line or in a file; see MANDEL_VIEW_USAGE in mandel-lib.h.
+ *
  */
 
 #include <stdio.h>
@@ -14,24 +17,26 @@
 
 #include "mandel-lib.h"
 
-#define MANDEL_MAX_ITERATION 100000
-
-/***************************
- * Compile-time parameters *
- ***************************/
+/***********************************************
+ * Run-time parameters, set by main() from the *
+ * command line, MANDEL_VIEW_DEFAULT otherwise *
+ ***********************************************/
 
 /*
  * Output at the terminal is is x_chars wide by y_chars long
 */
-int y_chars = 50;
-int x_chars = 90;
+int y_chars;
+int x_chars;
 
 /*
  * The part of the complex plane to be drawn:
  * upper left corner is (xmin, ymax), lower right corner is (xmax, ymin)
 */
-double xmin = -1.8, xmax = 1.0;
-double ymin = -1.0, ymax = 1.0;
+double xmin, xmax;
+double ymin, ymax;
+
+/* Iterations before a point counts as inside the set */
+int max_iteration;
 	
 /*
  * Every character in the final output is
@@ -50,6 +55,7 @@ void compute_mandel_line(int line, int color_val[])
 	 * x and y traverse the complex plane.
 	 */
 	double x, y;
+	double xs[x_chars], ys[x_chars];
 
 	int n;
 	int val;
@@ -57,48 +63,35 @@ void compute_mandel_line(int line, int color_val[])
 	/* Find out the y value corresponding to this line */
 	y = ymax - ystep * line;
 
-	/* and iterate for all points on this line */
+	/* collect the points on this line, then iterate for all of them at once */
 	for (x = xmin, n = 0; n < x_chars; x+= xstep, n++) {
+		xs[n] = x;
+		ys[n] = y;
+	}
+	mandel_iterations_at_points(xs, ys, color_val, x_chars, max_iteration);
 
-		/* Compute the point's color value */
-		val = mandel_iterations_at_point(x, y, MANDEL_MAX_ITERATION);
+	for (n = 0; n < x_chars; n++) {
+		/* Turn the point's iterations into a color value */
+		val = color_val[n];
 		if (val > 255)
 			val = 255;
 
 		/* And store it in the color_val[] array */
-		val = xterm_color(val);
-		color_val[n] = val;
+		color_val[n] = xterm_color(val);
 	}
 }
 
 /*
- * This function outputs an array of x_char color values
- * to a 256-color xterm.
+ * This function encodes an array of x_char color values
+ * for a 256-color xterm, into buf, and returns its length.
+ * *color is the color the terminal will be set to before it.
  */
-void output_mandel_line(int fd, int color_val[])
+size_t encode_mandel_line(char *buf, int color_val[], int *color)
 {
-	int i;
-	
-	char point ='@';
-	char newline='\n';
-
-	for (i = 0; i < x_chars; i++) {
-		/* Set the current color, then output the point */
-		set_xterm_color(fd, color_val[i]);
-		if (write(fd, &point, 1) != 1) {
-			perror("compute_and_output_mandel_line: write point");
-			exit(1);
-		}
-	}
-
-	/* Now that the line is done, output a newline character */
-	if (write(fd, &newline, 1) != 1) {
-		perror("compute_and_output_mandel_line: write newline");
-		exit(1);
-	}
+	return xterm_encode_line(buf, color_val, x_chars, color);
 }
 
-void compute_and_output_mandel_line(int fd, int line)
+size_t compute_and_encode_mandel_line(char *buf, int line, int *color)
 {
 	/*
 	 * A temporary array, used to hold color values for the line being drawn
@@ -106,24 +99,73 @@ void compute_and_output_mandel_line(int fd, int line)
 	int color_val[x_chars];
 
 	compute_mandel_line(line, color_val);
-	output_mandel_line(fd, color_val);
+	return encode_mandel_line(buf, color_val, color);
+}
+
+void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-W WIDTH] [-H HEIGHT] [-R XMIN,XMAX,YMIN,YMAX]\n"
+			"          [-I MAX_ITERATION] [-F FILE]\n\n"
+			MANDEL_VIEW_USAGE,
+			argv0);
+	exit(1);
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
-	int line;
+	struct mandel_view view = MANDEL_VIEW_DEFAULT;
+	int line, color = -1, opt, ret;
+	struct iovec *iov;
+	char *frame;
+
+	while ((opt = getopt(argc, argv, MANDEL_VIEW_OPTIONS)) != -1) {
+		ret = mandel_view_option(&view, opt, optarg);
+		if (ret < 0)
+			exit(1);
+		if (ret > 0)
+			usage(argv[0]);
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	x_chars = view.width;
+	y_chars = view.height;
+	xmin = view.xmin;
+	xmax = view.xmax;
+	ymin = view.ymin;
+	ymax = view.ymax;
+	max_iteration = view.max_iteration;
 
 	xstep = (xmax - xmin) / x_chars;
 	ystep = (ymax - ymin) / y_chars;
 
+	frame = malloc((size_t)y_chars * XTERM_LINE_SIZE(x_chars));
+	iov = malloc((y_chars + 1) * sizeof(*iov));
+	if (frame == NULL || iov == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		exit(1);
+	}
+
 	/*
-	 * draw the Mandelbrot Set, one line at a time.
-	 * Output is sent to file descriptor '1', i.e., standard output.
+	 * draw the Mandelbrot Set, one line at a time, into the frame.
 	 */
 	for (line = 0; line < y_chars; line++) {
-		compute_and_output_mandel_line(1, line);
+		iov[line].iov_base = frame + (size_t)line * XTERM_LINE_SIZE(x_chars);
+		iov[line].iov_len = compute_and_encode_mandel_line(iov[line].iov_base, line, &color);
+	}
+
+	/*
+	 * Output the frame and reset the colors, all at once.
+	 * Output is sent to file descriptor '1', i.e., standard output.
+	 */
+	iov[y_chars].iov_base = "\033[0m";
+	iov[y_chars].iov_len = 4;
+	if (insist_writev(1, iov, y_chars + 1) < 0) {
+		perror("main: insist_writev");
+		exit(1);
 	}
 
-	reset_xterm_color(1);
+	free(frame);
+	free(iov);
 	return 0;
 }
@@ -0,0 +1,353 @@
+/*
+ * spawn-bench.c
+ *
+ * Measures what it costs to start a child, the way rand-fork.c starts
+ * them: fork, vfork, posix_spawn, clone with a few sets of flags and
+ * pthread_create, each with parent heaps from 1 MB to 8 GB, since
+ * copying the page tables of a big parent is most of the cost of fork.
+ *
+ * For every method and heap size it reports, as JSON on standard output:
+ *   start_us: from the call to the child running its first instruction
+ *             (not for posix_spawn, whose child is another program)
+ *   total_us: from the call to the parent having reaped (joined) it
+ *   per_sec:  children started and reaped per second, one at a time
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <spawn.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/*
+ * POSIX thread functions do not return error numbers in errno,
+ * but in the actual return value of the function call instead.
+ * This macro helps with error reporting in this case.
+ */
+#define perror_pthread(ret, msg) \
+	do { errno = ret; perror(msg); } while (0)
+
+#define CHILD_STACK_SIZE	(64 << 10)
+
+/* heaps above this get fewer iterations, since fork alone takes ms there */
+#define FULL_ITERS_MB		256
+#define MIN_ITERS		10
+
+extern char **environ;
+
+enum method {
+	M_FORK,
+	M_VFORK,
+	M_POSIX_SPAWN,
+	M_CLONE,		/* clone(SIGCHLD): a fork */
+	M_CLONE_VM,		/* shares the address space, no page tables to copy */
+	M_CLONE_VM_VFORK,	/* the same, with the parent suspended until exit */
+	M_CLONE_THREAD_LIKE,	/* shares VM, files, fs and signal handlers */
+	M_PTHREAD,
+	NR_METHODS
+};
+
+static const char *method_names[NR_METHODS] = {
+	[M_FORK] = "fork",
+	[M_VFORK] = "vfork",
+	[M_POSIX_SPAWN] = "posix_spawn",
+	[M_CLONE] = "clone",
+	[M_CLONE_VM] = "clone_vm",
+	[M_CLONE_VM_VFORK] = "clone_vm_vfork",
+	[M_CLONE_THREAD_LIKE] = "clone_vm_files_fs_sighand",
+	[M_PTHREAD] = "pthread_create",
+};
+
+static const int clone_flags[NR_METHODS] = {
+	[M_CLONE] = SIGCHLD,
+	[M_CLONE_VM] = CLONE_VM | SIGCHLD,
+	[M_CLONE_VM_VFORK] = CLONE_VM | CLONE_VFORK | SIGCHLD,
+	[M_CLONE_THREAD_LIKE] = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | SIGCHLD,
+};
+
+static const long heap_sizes_mb[] = { 1, 8, 64, 512, 1024, 4096, 8192 };
+#define NR_HEAP_SIZES	(sizeof(heap_sizes_mb) / sizeof(heap_sizes_mb[0]))
+
+/*
+ * Where a child stores the time it started. It is in a MAP_SHARED page,
+ * so that children with an address space of their own can write it too.
+ */
+static volatile double *child_start;
+
+static char *exec_path = "/bin/true";
+
+void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-n ITERATIONS] [-m MAX_HEAP_MB] [-e PROGRAM]\n\n"
+			"    -n ITERATIONS: children per method and heap size (default 200)\n"
+			"    -m MAX_HEAP_MB: largest parent heap, in MB (default 8192)\n"
+			"    -e PROGRAM: what posix_spawn runs (default /bin/true)\n"
+			"    Heap sizes that do not fit in the free memory are skipped.\n",
+			argv0);
+	exit(1);
+}
+
+/*
+ * Function for safe atoi from pthread-test.c
+ */
+int safe_atoi(char *s, int *val)
+{
+	long l;
+	char *endp;
+
+	l = strtol(s, &endp, 10);
+	if (s != endp && *endp == '\0') {
+		*val = l;
+		return 0;
+	} else
+		return -1;
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int child_fn(void *arg)
+{
+	*child_start = now_us();
+	return 0;
+}
+
+static void *thread_fn(void *arg)
+{
+	*child_start = now_us();
+	return NULL;
+}
+
+static void reap(pid_t pid, int options)
+{
+	int status;
+
+	if (waitpid(pid, &status, options) < 0) {
+		perror("waitpid");
+		exit(1);
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "child %ld failed\n", (long)pid);
+		exit(1);
+	}
+}
+
+/* starts and reaps one child, stores its start and total latency */
+static void spawn_one(enum method m, char *stack, double *start, double *total)
+{
+	char *argv[] = { exec_path, NULL };
+	pthread_t tid;
+	double t0;
+	pid_t pid;
+	int ret;
+
+	*child_start = 0;
+	t0 = now_us();
+
+	switch (m) {
+	case M_FORK:
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			exit(1);
+		}
+		if (pid == 0) {
+			child_fn(NULL);
+			_exit(0);
+		}
+		reap(pid, 0);
+		break;
+	case M_VFORK:
+		pid = vfork();
+		if (pid < 0) {
+			perror("vfork");
+			exit(1);
+		}
+		if (pid == 0) {
+			child_fn(NULL);
+			_exit(0);
+		}
+		reap(pid, 0);
+		break;
+	case M_POSIX_SPAWN:
+		ret = posix_spawn(&pid, exec_path, NULL, NULL, argv, environ);
+		if (ret) {
+			perror_pthread(ret, "posix_spawn");
+			exit(1);
+		}
+		reap(pid, 0);
+		break;
+	case M_PTHREAD:
+		ret = pthread_create(&tid, NULL, thread_fn, NULL);
+		if (ret) {
+			perror_pthread(ret, "pthread_create");
+			exit(1);
+		}
+		ret = pthread_join(tid, NULL);
+		if (ret) {
+			perror_pthread(ret, "pthread_join");
+			exit(1);
+		}
+		break;
+	default:
+		/* the stack grows down on every architecture we run on */
+		pid = clone(child_fn, stack + CHILD_STACK_SIZE, clone_flags[m], NULL);
+		if (pid < 0) {
+			perror("clone");
+			exit(1);
+		}
+		reap(pid, 0);
+		break;
+	}
+
+	*total = now_us() - t0;
+	*start = m == M_POSIX_SPAWN ? -1 : *child_start - t0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_stats(const char *name, double *v, int n)
+{
+	double sum = 0;
+	int i;
+
+	qsort(v, n, sizeof(*v), cmp_double);
+	for (i = 0; i < n; i++)
+		sum += v[i];
+	printf("\"%s\": {\"mean\": %.2f, \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f}",
+		name, sum / n, v[n / 2], v[n * 90 / 100], v[n * 99 / 100], v[n - 1]);
+}
+
+/* a heap of mb MB, every page of it touched so that the child has to map it */
+static char *make_heap(long mb)
+{
+	size_t len = (size_t)mb << 20;
+	char *heap;
+
+	heap = malloc(len);
+	if (heap == NULL) {
+		fprintf(stderr, "cannot allocate a heap of %ld MB\n", mb);
+		exit(1);
+	}
+	memset(heap, 1, len);
+	return heap;
+}
+
+static void bench_heap(long mb, int iters, char *stack, int *first)
+{
+	double *start, *total, begin, elapsed;
+	char *heap;
+	int m, i, n;
+
+	n = mb > FULL_ITERS_MB ? iters * FULL_ITERS_MB / mb : iters;
+	if (n < MIN_ITERS)
+		n = MIN_ITERS;
+
+	heap = make_heap(mb);
+	start = malloc(n * sizeof(*start));
+	total = malloc(n * sizeof(*total));
+	if (start == NULL || total == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		exit(1);
+	}
+
+	for (m = 0; m < NR_METHODS; m++) {
+		/* one untimed run, to fault in the code and the stacks */
+		spawn_one(m, stack, &start[0], &total[0]);
+
+		begin = now_us();
+		for (i = 0; i < n; i++)
+			spawn_one(m, stack, &start[i], &total[i]);
+		elapsed = now_us() - begin;
+
+		printf("%s\n    {\"method\": \"%s\", \"heap_mb\": %ld, \"iterations\": %d, ",
+			*first ? "" : ",", method_names[m], mb, n);
+		*first = 0;
+		if (m != M_POSIX_SPAWN)
+			print_stats("start_us", start, n);
+		else
+			printf("\"start_us\": null");
+		printf(", ");
+		print_stats("total_us", total, n);
+		printf(", \"per_sec\": %.1f}", n / elapsed * 1e6);
+		fflush(stdout);
+	}
+
+	free(start);
+	free(total);
+	free(heap);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, iters = 200, max_mb = 8192, first = 1;
+	long avail_mb;
+	char *stack;
+	size_t i;
+
+	while ((opt = getopt(argc, argv, "n:m:e:")) != -1) {
+		switch (opt) {
+		case 'n':
+			if (safe_atoi(optarg, &iters) < 0 || iters <= 0)
+				usage(argv[0]);
+			break;
+		case 'm':
+			if (safe_atoi(optarg, &max_mb) < 0 || max_mb <= 0)
+				usage(argv[0]);
+			break;
+		case 'e':
+			exec_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	child_start = mmap(NULL, sysconf(_SC_PAGE_SIZE), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	stack = mmap(NULL, CHILD_STACK_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (child_start == MAP_FAILED || stack == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	/* leave a quarter of the free memory for everything else */
+	avail_mb = sysconf(_SC_AVPHYS_PAGES) / 4 * 3 / (1048576 / sysconf(_SC_PAGE_SIZE));
+
+	printf("{\"cpus\": %ld, \"results\": [", sysconf(_SC_NPROCESSORS_ONLN));
+	for (i = 0; i < NR_HEAP_SIZES && heap_sizes_mb[i] <= max_mb; i++) {
+		if (heap_sizes_mb[i] > avail_mb) {
+			printf("%s\n    {\"heap_mb\": %ld, \"skipped\": \"not enough free memory\"}",
+				first ? "" : ",", heap_sizes_mb[i]);
+			first = 0;
+			continue;
+		}
+		bench_heap(heap_sizes_mb[i], iters, stack, &first);
+	}
+	printf("\n]}\n");
+
+	return 0;
+}
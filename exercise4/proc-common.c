@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/prctl.h>
@@ -26,12 +27,143 @@ wait_forever(void)
  */
 void compute(int count)
 {
-	long i;
-	volatile long junk;
+	cpu_burn(BURN_CPU, count * 1000L);
+}
+
+
+/******************************************************************************
+ * Calibrated CPU burn
+ */
+
+/* work is done in units of BURN_STEPS steps, the clock is read once per slice */
+#define BURN_STEPS		64
+#define BURN_SLICE_US		200
+#define BURN_CALIBRATE_US	5000
+
+#define BURN_CACHE_BYTES	(16 << 10)
+#define BURN_MEMORY_BYTES	(64 << 20)
+
+static double burn_units_per_us[NR_BURN_KINDS];
+static unsigned *burn_chain[NR_BURN_KINDS];
+
+static volatile unsigned long burn_sink;
+
+static double burn_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * A single random cycle through all the entries (Sattolo's algorithm),
+ * so that every step of the chase depends on the previous one and the
+ * prefetcher cannot guess the next.
+ */
+static unsigned *burn_make_chain(size_t bytes)
+{
+	size_t i, j, n = bytes / sizeof(unsigned);
+	unsigned *chain, tmp, seed = 12345;
+
+	chain = malloc(bytes);
+	if (chain == NULL) {
+		fprintf(stderr, "cpu_burn: allocation failed\n");
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		chain[i] = i;
+	for (i = n - 1; i > 0; i--) {
+		seed = seed * 1103515245 + 12345;
+		j = ((size_t)seed << 16 ^ seed >> 8) % i;
+		tmp = chain[i];
+		chain[i] = chain[j];
+		chain[j] = tmp;
+	}
+	return chain;
+}
+
+static void burn_units(enum burn_kind kind, unsigned long units)
+{
+	unsigned long x = burn_sink, i, j;
+	unsigned *chain = burn_chain[kind];
+
+	switch (kind) {
+	case BURN_CPU:
+		for (i = 0; i < units; i++)
+			for (j = 0; j < BURN_STEPS; j++)
+				x = x * 6364136223846793005UL + 1442695040888963407UL;
+		break;
+	case BURN_CACHE:
+	case BURN_MEMORY:
+		x = chain[x % 2];
+		for (i = 0; i < units; i++)
+			for (j = 0; j < BURN_STEPS; j++)
+				x = chain[x];
+		break;
+	default:
+		break;
+	}
+	burn_sink = x;
+}
+
+static void burn_calibrate_kind(enum burn_kind kind)
+{
+	unsigned long units = 1, done = 0;
+	double start, elapsed;
+
+	if (kind == BURN_CACHE)
+		burn_chain[kind] = burn_make_chain(BURN_CACHE_BYTES);
+	else if (kind == BURN_MEMORY)
+		burn_chain[kind] = burn_make_chain(BURN_MEMORY_BYTES);
+
+	/* one pass to warm up the caches (or to fill the TLB with misses) */
+	burn_units(kind, 64);
+
+	start = burn_now_us();
+	do {
+		burn_units(kind, units);
+		done += units;
+		units *= 2;
+		elapsed = burn_now_us() - start;
+	} while (elapsed < BURN_CALIBRATE_US);
+
+	burn_units_per_us[kind] = done / elapsed;
+}
+
+void
+cpu_burn_calibrate(void)
+{
+	int kind;
+
+	for (kind = 0; kind < NR_BURN_KINDS; kind++)
+		if (burn_units_per_us[kind] == 0)
+			burn_calibrate_kind(kind);
+}
+
+void
+cpu_burn(enum burn_kind kind, long us)
+{
+	double start, left;
+	unsigned long units;
+
+	if (kind < 0 || kind >= NR_BURN_KINDS) {
+		fprintf(stderr, "%s: invalid kind %d\n", __func__, kind);
+		exit(1);
+	}
+	if (burn_units_per_us[kind] == 0)
+		burn_calibrate_kind(kind);
 
-	junk = 0;
-	for (i = 0; i < count * 1000000; i++) {
-		junk++;
+	/*
+	 * The calibration only sizes the slices: the clock decides when to
+	 * stop, so a wrong estimate costs at most one slice.
+	 */
+	start = burn_now_us();
+	while ((left = us - (burn_now_us() - start)) > 0) {
+		if (left > BURN_SLICE_US)
+			left = BURN_SLICE_US;
+		units = left * burn_units_per_us[kind];
+		burn_units(kind, units > 0 ? units : 1);
 	}
 }
 
@@ -5,9 +5,32 @@
  * Helper Functions
  */
 
-/* does useless computation */
+/* does useless computation, for count ms of CPU time (see cpu_burn()) */
 void compute(int count);
 
+/*
+ * Calibrated busy work: cpu_burn() runs for a given amount of CPU time
+ * of the calling thread (CLOCK_THREAD_CPUTIME_ID), so it takes the same
+ * time whatever the CPU, the compiler or the clock frequency, and time
+ * the thread spends preempted does not count.
+ */
+enum burn_kind {
+	BURN_CPU,		/* arithmetic in registers */
+	BURN_CACHE,		/* pointer chasing in a buffer that fits in L1 */
+	BURN_MEMORY,		/* pointer chasing in a buffer far bigger than the caches */
+	NR_BURN_KINDS
+};
+
+/*
+ * Measures how much work of each kind fits in a microsecond. cpu_burn()
+ * calibrates on first use; calling this at startup keeps it out of the
+ * timings, and children forked afterwards inherit the results.
+ */
+void cpu_burn_calibrate(void);
+
+/* burns us microseconds of CPU time with work of the given kind */
+void cpu_burn(enum burn_kind kind, long us);
+
 /* Does nothing and never returns. */
 void wait_forever(void);
 